@@ -5,9 +5,12 @@
 #include <termios.h>
 #include <syslog.h>
 #include <string.h>
+#include <inttypes.h>
 #include "driver/driver.h"
 #include "driver/serial-io.h"
 #include "osp.h"
+#include "osp-replay.h"
+#include "osp-aiding.h"
 
 #define execf(f) \
     if ((f)) {\
@@ -26,6 +29,9 @@ static struct argp_option options[] = {
     {"noinit", 'n', 0, 0, "do not send data initialization frame"},
     {"osp", 'o', 0, 0, "switch from NMEA to OSP protocol"},
     {"listen", 'l', 0, 0, "do not exit, listen messages"},
+    {"replay", 'r', "FILE", 0, "replay raw dump or capture instead of using device"},
+    {"capture", 'c', "FILE", 0, "record frames to capture file"},
+    {"aiding", 'a', "FILE", 0, "keep aiding data in file and start from it"},
     { 0 }
 };
 static struct argp argp = { options, parse_opt, 0, doc };
@@ -37,6 +43,9 @@ struct arguments {
     int osp;
     int listen;
     int version;
+    char *replay;
+    char *capture;
+    char *aiding;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
@@ -62,6 +71,17 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'o':
             arguments->osp = 1;
             break;
+        case 'c':
+            arguments->capture = arg;
+            break;
+        case 'a':
+            arguments->aiding = arg;
+            break;
+        case 'r':
+            arguments->replay = arg;
+            arguments->noinit = 1;
+            arguments->listen = 1;
+            break;
         case ARGP_KEY_ARG:
         case ARGP_KEY_END:
         default:
@@ -82,6 +102,40 @@ static void force_osp(io_t *serial, char *dev)
     if (!err) (err = (serial->close(serial)));
 }
 
+static void print_nmea(void *arg, const char *sentence, size_t length)
+{
+    printf("< |%.*s|\n", (int)length, sentence);
+}
+
+static void print_visible(void *arg, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
+{
+    int i;
+    printf("Number of visible satellites: %d\n", msg->mid13.svs);
+    for(i = 0; i < msg->mid13.svs; i++)
+        printf("SVID: %d, (%d, %d)\n",
+                msg->mid13.ch[i].svid,
+                msg->mid13.ch[i].azimuth,
+                msg->mid13.ch[i].elevation);
+}
+
+static void print_startup(const osp_startup_report_t *report)
+{
+    static const char *phases[OSP_STARTUP_PHASES] = {
+        [OSP_STARTUP_INIT] = "init",
+        [OSP_STARTUP_READY] = "ready",
+        [OSP_STARTUP_HW_CONFIG] = "hw config",
+        [OSP_STARTUP_POSITION] = "position",
+        [OSP_STARTUP_TIME] = "time",
+        [OSP_STARTUP_SESSION] = "session",
+    };
+    int i;
+    for (i = 0; i < OSP_STARTUP_PHASES; i++) {
+        if (report->reached & (1u << i))
+            printf("%s: %" PRIu32 " ms\n", phases[i], report->at_us[i] / 1000);
+    }
+}
+
 static void sig_ignore(int signum)
 {
 }
@@ -100,16 +154,31 @@ int main(int argc, char* argv[])
 
     argp_parse(&argp, argc, argv, 0, NULL, &arguments);
 
-    io_t *serial = serial_alloc();
+    io_t *serial = arguments.replay ? osp_replay_alloc(arguments.replay, false)
+                                    : serial_alloc();
     io_t *transport = osp_transport_alloc(serial);
+    osp_transport_nmea(transport, print_nmea, NULL);
     driver_t *driver = driver_alloc(transport);
     osp_t *osp;
     osp = osp_alloc(driver, NULL, NULL);
+    osp_set_transport(osp, transport);
+    osp_subscribe(osp, 13, OSP_SID_ANY, print_visible, NULL);
+    osp_capture_t *capture = NULL;
+    if (arguments.capture) {
+        if ((capture = osp_capture_open(arguments.capture, 1 << 20)))
+            osp_set_capture(osp, capture);
+        else
+            printf("capture: %s\n", strerror(errno));
+    }
+    osp_aiding_t *aiding = NULL;
+    if (arguments.aiding && !(aiding = osp_aiding_open(arguments.aiding)))
+        printf("aiding: %s\n", strerror(errno));
 
-    if (arguments.osp)
+    if (arguments.osp && !arguments.replay)
         force_osp(serial, arguments.device);
 
-    serial_config(serial, arguments.device, B115200);
+    if (!arguments.replay)
+        serial_config(serial, arguments.device, B115200);
     osp_start(osp);
     usleep(10*1000);
 
@@ -117,10 +186,17 @@ int main(int argc, char* argv[])
         execf(osp_factory(osp, false, false));
     } else {
         if (!arguments.noinit) {
-            execf(osp_init(osp, true, NULL, 0));
-            execf(osp_wait_for_ready(osp));
-            sleep(1); /* Wait for HW request. (FIXME) */
-            execf(osp_open_session(osp, false));
+            osp_startup_report_t report;
+            osp_position_t seed, *seedp = NULL;
+            uint32_t clock_drift = 0;
+            if (aiding && !osp_aiding_seed(aiding, &seed, &clock_drift))
+                seedp = &seed;
+            execf(osp_startup(osp, true, seedp, clock_drift, &report));
+            print_startup(&report);
+            if (aiding) {
+                execf(osp_aiding_inject(aiding, osp));
+                osp_aiding_start(aiding, osp, 60);
+            }
         }
 
         if (arguments.version) {
@@ -140,10 +216,22 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (aiding)
+        osp_aiding_close(aiding);
     osp_stop(osp);
-    free(osp);
+    osp_transport_stats_t stats;
+    osp_transport_stats(transport, &stats);
+    printf("in: %" PRIu64 "B, out: %" PRIu64 "B, bad checksum: %" PRIu64
+           ", bad tail: %" PRIu64 ", skipped: %" PRIu64 "B\n",
+           stats.bytes_in, stats.bytes_out, stats.bad_checksum,
+           stats.bad_tail, stats.skipped);
+    if (capture) {
+        osp_set_capture(osp, NULL);
+        osp_capture_close(capture);
+    }
+    osp_free(osp);
     free(driver);
-    free(transport);
+    osp_transport_free(transport);
     free(serial);
     closelog();
     return 0;
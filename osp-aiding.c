@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "osp-aiding.h"
+
+#define SVS 32
+
+struct record {
+    uint32_t crc;               /* of rest of record */
+    uint32_t seq;               /* newer copy has higher */
+    int64_t saved;              /* CLOCK_REALTIME, s */
+};
+
+struct almanac_record {
+    struct record r;
+    almanac_t almanac;
+};
+
+/* Rewritten only when ephemeris changes, so saved is when it was first
+ * seen */
+struct ephemeris_record {
+    struct record r;
+    ephemeris_t eph;
+};
+
+/* Saved is time of fix */
+struct nav_record {
+    struct record r;
+    osp_position_t position;
+    int32_t clock_drift;
+};
+
+struct aiding_file {
+    char magic[OSP_AIDING_MAGIC_LEN];
+    struct almanac_record almanac[2];
+    struct ephemeris_record ephemeris[SVS][2];
+    struct nav_record nav[2];
+};
+
+struct osp_aiding {
+    int fd;
+    struct aiding_file *file;
+
+    /* guards file and fix */
+    pthread_mutex_t lock;
+    struct nav_record fix;
+    bool fix_valid;
+
+    /* snapshots of osp, if started */
+    osp_t *osp;
+    unsigned period;
+    bool stop;
+    pthread_t writer;
+    pthread_cond_t signal;      /* CLOCK_MONOTONIC */
+};
+
+static uint32_t crc32(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint32_t crc = ~0u;
+    int i;
+
+    while (size--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static bool intact(const struct record *r, size_t size)
+{
+    return r->seq && r->crc == crc32(&r->seq, size - sizeof(r->crc));
+}
+
+/* Newer of two copies passing CRC, NULL if none does */
+static const void* latest(const void *copies, size_t size)
+{
+    const struct record *a = copies;
+    const struct record *b = (const void*)((const uint8_t*)copies + size);
+    bool va = intact(a, size);
+    bool vb = intact(b, size);
+
+    if (va && vb)
+        return (int32_t)(b->seq - a->seq) > 0 ? b : a;
+    return va ? a : vb ? b : NULL;
+}
+
+/* Write record over older copy. Record must be zeroed before it was
+ * filled, so padding is part of CRC too. */
+static void put(void *copies, const struct record *rec, size_t size)
+{
+    struct record *a = copies;
+    struct record *b = (void*)((uint8_t*)copies + size);
+    const struct record *last = latest(copies, size);
+    struct record *dst = last == a ? b : a;
+    uint8_t buf[size];
+    struct record *r = (struct record*)buf;
+
+    memcpy(buf, rec, size);
+    r->seq = last ? last->seq + 1 : 1;
+    r->crc = crc32(&r->seq, size - sizeof(r->crc));
+    memcpy(dst, buf, size);
+}
+
+static bool fresh(const struct record *r, int64_t age)
+{
+    int64_t now = time(NULL);
+    /* saved in future, clock was not set then or is not now */
+    return r->saved <= now && now - r->saved < age;
+}
+
+static bool all_zero(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    while (size--) {
+        if (*p++)
+            return false;
+    }
+    return true;
+}
+
+static void nav_fix(void *arg, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
+{
+    osp_aiding_t *store = arg;
+    const osp_mid41_t *mid = &msg->mid41;
+
+    if (mid->nav_valid || !mid->svs_in_fix)
+        return;
+    pthread_mutex_lock(&store->lock);
+    memset(&store->fix, 0, sizeof(store->fix));
+    store->fix.r.saved = time(NULL);
+    store->fix.position.lat = mid->latitude;
+    store->fix.position.lon = mid->longitude;
+    store->fix.position.alt = mid->altitude_msl;
+    store->fix.position.err_h = mid->est_h_pos_error/100;
+    store->fix.position.err_v = mid->est_v_pos_error/100;
+    store->fix.clock_drift = mid->clock_drift;
+    store->fix_valid = true;
+    pthread_mutex_unlock(&store->lock);
+}
+
+static void* snapshot_thread(void *arg)
+{
+    osp_aiding_t *store = arg;
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    pthread_mutex_lock(&store->lock);
+    for (;;) {
+        due.tv_sec += store->period;
+        while (!store->stop &&
+                !pthread_cond_timedwait(&store->signal, &store->lock, &due))
+            ;
+        if (store->stop)
+            break;
+        pthread_mutex_unlock(&store->lock);
+        osp_aiding_snapshot(store, store->osp);
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+osp_aiding_t* osp_aiding_open(const char *path)
+{
+    osp_aiding_t *store;
+    pthread_condattr_t attr;
+    struct stat st;
+    void *map;
+
+    if (!(store = calloc(1, sizeof(osp_aiding_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((store->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        goto aiding_error;
+    if (fstat(store->fd, &st) < 0)
+        goto aiding_error;
+    if (st.st_size != sizeof(struct aiding_file) &&
+            (ftruncate(store->fd, 0) < 0 ||
+             ftruncate(store->fd, sizeof(struct aiding_file)) < 0))
+        goto aiding_error;
+    map = mmap(NULL, sizeof(struct aiding_file), PROT_READ | PROT_WRITE,
+            MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED)
+        goto aiding_error;
+    store->file = map;
+    if (memcmp(store->file->magic, OSP_AIDING_MAGIC, OSP_AIDING_MAGIC_LEN)) {
+        memset(store->file, 0, sizeof(struct aiding_file));
+        memcpy(store->file->magic, OSP_AIDING_MAGIC, OSP_AIDING_MAGIC_LEN);
+        msync(store->file, sizeof(struct aiding_file), MS_SYNC);
+    }
+
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->signal, &attr);
+    pthread_condattr_destroy(&attr);
+    return store;
+
+aiding_error:
+    if (store->fd >= 0)
+        close(store->fd);
+    free(store);
+    return NULL;
+}
+
+void osp_aiding_close(osp_aiding_t *store)
+{
+    if (store->osp)
+        osp_aiding_stop(store);
+    msync(store->file, sizeof(struct aiding_file), MS_SYNC);
+    munmap(store->file, sizeof(struct aiding_file));
+    close(store->fd);
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->signal);
+    free(store);
+}
+
+int osp_aiding_start(osp_aiding_t *store, osp_t *osp, unsigned period)
+{
+    if (store->osp || !period) {
+        errno = store->osp ? EBUSY : EINVAL;
+        return -1;
+    }
+    if (osp_subscribe(osp, 41, OSP_SID_ANY, nav_fix, store))
+        return -1;
+    store->osp = osp;
+    store->period = period;
+    store->stop = false;
+    if ((errno = pthread_create(&store->writer, NULL, snapshot_thread, store))) {
+        osp_unsubscribe(osp, 41, nav_fix, store);
+        store->osp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void osp_aiding_stop(osp_aiding_t *store)
+{
+    pthread_mutex_lock(&store->lock);
+    store->stop = true;
+    pthread_cond_signal(&store->signal);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->writer, NULL);
+    osp_unsubscribe(store->osp, 41, nav_fix, store);
+    store->osp = NULL;
+}
+
+int osp_aiding_snapshot(osp_aiding_t *store, osp_t *osp)
+{
+    struct almanac_record almanac;
+    struct ephemeris_record rec;
+    const struct ephemeris_record *last;
+    ephemeris_t eph[12];
+    int64_t now = time(NULL);
+    int retval, count, i;
+    uint8_t svid;
+
+    memset(&almanac, 0, sizeof(almanac));
+    retval = osp_almanac_poll(osp, &almanac.almanac);
+    /* receiver without almanac must not wipe one stored */
+    if (!retval && !all_zero(almanac.almanac, sizeof(almanac_t))) {
+        almanac.r.saved = now;
+        pthread_mutex_lock(&store->lock);
+        put(store->file->almanac, &almanac.r, sizeof(almanac));
+        pthread_mutex_unlock(&store->lock);
+    }
+
+    /* count of ephemerides or error */
+    count = osp_ephemeris_poll(osp, 0, eph);
+    if (count < 0 || count > 12) {
+        if (!retval)
+            retval = count;
+        count = 0;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    for (i = 0; i < count; i++) {
+        svid = eph[i].svid;
+        if (svid < 1 || svid > SVS || all_zero(eph[i].data, sizeof(eph[i].data)))
+            continue;
+        last = latest(store->file->ephemeris[svid - 1], sizeof(rec));
+        if (last && !memcmp(last->eph.data, eph[i].data, sizeof(eph[i].data)))
+            continue;
+        memset(&rec, 0, sizeof(rec));
+        rec.r.saved = now;
+        rec.eph.svid = svid;
+        memcpy(rec.eph.data, eph[i].data, sizeof(rec.eph.data));
+        put(store->file->ephemeris[svid - 1], &rec.r, sizeof(rec));
+    }
+    if (store->fix_valid) {
+        put(store->file->nav, &store->fix.r, sizeof(store->fix));
+        store->fix_valid = false;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    msync(store->file, sizeof(struct aiding_file), MS_SYNC);
+    return retval;
+}
+
+int osp_aiding_seed(osp_aiding_t *store, osp_position_t *seed,
+        uint32_t *clock_drift)
+{
+    const struct nav_record *nav;
+    int64_t age;
+    int retval = -1;
+
+    pthread_mutex_lock(&store->lock);
+    nav = latest(store->file->nav, sizeof(*nav));
+    if (nav && fresh(&nav->r, OSP_AIDING_POSITION_AGE)) {
+        /* seed carries error it has now, not at the fix */
+        age = time(NULL) - nav->r.saved;
+        *seed = nav->position;
+        seed->err_h += age * OSP_POSITION_GROWTH;
+        seed->err_v += age * OSP_POSITION_GROWTH;
+        *clock_drift = nav->clock_drift;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (retval)
+        errno = ENOENT;
+    return retval;
+}
+
+int osp_aiding_inject(osp_aiding_t *store, osp_t *osp)
+{
+    const struct almanac_record *almanac;
+    const struct ephemeris_record *rec;
+    almanac_t alm;
+    ephemeris_t eph[SVS];
+    bool have_almanac = false;
+    int retval = 0, rv;
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock(&store->lock);
+    almanac = latest(store->file->almanac, sizeof(*almanac));
+    if (almanac && fresh(&almanac->r, OSP_AIDING_ALMANAC_AGE)) {
+        memcpy(alm, almanac->almanac, sizeof(alm));
+        have_almanac = true;
+    }
+    for (i = 0; i < SVS; i++) {
+        rec = latest(store->file->ephemeris[i], sizeof(*rec));
+        if (rec && fresh(&rec->r, OSP_AIDING_EPHEMERIS_AGE))
+            eph[count++] = rec->eph;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (have_almanac)
+        retval = osp_almanac_set(osp, &alm);
+    if (count) {
+        rv = osp_ephemeris_set_all(osp, eph, count);
+        if (!retval)
+            retval = rv;
+    }
+    return retval;
+}
+
+/* vim: set ts=4 sw=4 et: */
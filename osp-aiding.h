@@ -0,0 +1,46 @@
+#ifndef _OSP_AIDING_H
+#define _OSP_AIDING_H
+
+#include "osp.h"
+
+/* Aiding store is a file mapped to memory holding last almanac, ephemeris
+ * of every SV, last good position and clock drift, so they can be given
+ * back to receiver after reboot. Every record is kept twice with its CRC
+ * and only the older copy is overwritten; a crash in the middle of writing
+ * leaves the newer one intact. File is in host byte order. */
+#define OSP_AIDING_MAGIC "OSPAID\0\1"
+#define OSP_AIDING_MAGIC_LEN 8
+
+/* Records older than these, in s, are not injected */
+#define OSP_AIDING_ALMANAC_AGE      (30*24*3600)
+#define OSP_AIDING_EPHEMERIS_AGE    (3*3600)    /* since first seen, fit interval is 4 h */
+#define OSP_AIDING_POSITION_AGE     (24*3600)
+
+typedef struct osp_aiding osp_aiding_t;
+
+/* Open store, creating it or starting it over when file is not one */
+osp_aiding_t* osp_aiding_open(const char *path);
+void osp_aiding_close(osp_aiding_t *store);
+
+/* Keep store up to date: position and drift of every valid fix are kept
+ * in memory, and all is polled and written every period seconds from a
+ * background thread. Stop before osp is freed. */
+int osp_aiding_start(osp_aiding_t *store, osp_t *osp, unsigned period);
+void osp_aiding_stop(osp_aiding_t *store);
+
+/* Poll almanac and ephemerides and write them with last fix now. Returns
+ * 0 or result of first command failing. */
+int osp_aiding_snapshot(osp_aiding_t *store, osp_t *osp);
+
+/* Position and drift still valid, to seed osp_startup() with. Returns 0,
+ * or -1 with errno ENOENT if there is none. */
+int osp_aiding_seed(osp_aiding_t *store, osp_position_t *seed,
+        uint32_t *clock_drift);
+
+/* Set almanac and ephemerides still valid, once session is open. Returns
+ * 0 or result of first command failing. */
+int osp_aiding_inject(osp_aiding_t *store, osp_t *osp);
+
+#endif /* _OSP_AIDING_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,307 @@
+#ifndef _OSP_BUILDER_H
+#define _OSP_BUILDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "osp-protocol.h"
+
+/* Serializers for outgoing commands. Every byte of a frame is written
+ * explicitly in wire order, so a caller only needs a buffer of the frame's
+ * length and no memset. Lengths include the MID byte and are checked
+ * against the packed layouts in osp-protocol.h at compile time. */
+
+#define OSP_MID128_LEN          25
+#define OSP_MID130_LEN          (1 + 32*28)
+#define OSP_MID132_LEN          2
+#define OSP_MID146_LEN          2
+#define OSP_MID147_LEN          3
+#define OSP_MID149_LEN          (1 + 45*2)
+#define OSP_MID166_LEN          8
+#define OSP_MID213_LEN          3
+#define OSP_MID214_LEN          8
+#define OSP_MID215_SID1_LEN     (2 + 14)
+#define OSP_MID215_SID2_LEN     (2 + 12)
+#define OSP_MID216_LEN          5
+#define OSP_MID218_FULL_LEN     2
+#define OSP_MID218_PTF_LEN      (2 + 12)
+#define OSP_MID220_LEN          3
+#define OSP_MID232_LEN          6
+
+_Static_assert(OSP_MID128_LEN == 1 + sizeof(struct mid128), "MID128 layout");
+_Static_assert(OSP_MID130_LEN == 1 + sizeof(struct mid130), "MID130 layout");
+_Static_assert(OSP_MID132_LEN == 1 + sizeof(struct mid132), "MID132 layout");
+_Static_assert(OSP_MID146_LEN == 1 + sizeof(struct mid146), "MID146 layout");
+_Static_assert(OSP_MID147_LEN == 1 + sizeof(struct mid147), "MID147 layout");
+_Static_assert(OSP_MID149_LEN == 1 + sizeof(struct mid149), "MID149 layout");
+_Static_assert(OSP_MID166_LEN == 1 + sizeof(struct mid166), "MID166 layout");
+_Static_assert(OSP_MID213_LEN == 1 + sizeof(struct mid213), "MID213 layout");
+_Static_assert(OSP_MID214_LEN == 1 + sizeof(struct mid214), "MID214 layout");
+_Static_assert(OSP_MID215_SID1_LEN == 2 + sizeof(((struct mid215*)0)->sid1), "MID215 layout");
+_Static_assert(OSP_MID215_SID2_LEN == 2 + sizeof(((struct mid215*)0)->sid2), "MID215 layout");
+_Static_assert(OSP_MID216_LEN == 1 + sizeof(struct mid216), "MID216 layout");
+_Static_assert(OSP_MID218_PTF_LEN == 2 + sizeof(struct ptf), "MID218 layout");
+_Static_assert(OSP_MID220_LEN == 1 + sizeof(struct mid220), "MID220 layout");
+_Static_assert(OSP_MID232_LEN == 1 + sizeof(struct mid232), "MID232 layout");
+
+/* MID128 reset flags, soft variant */
+#define OSP_INIT_SEED_VALID     0x01
+#define OSP_INIT_WARM           0x02
+#define OSP_INIT_COLD           0x04
+#define OSP_INIT_FACTORY        0x08
+#define OSP_INIT_NAV_LIB        0x10
+#define OSP_INIT_DEBUG          0x20
+#define OSP_INIT_SYSTEM_RESET   0x80
+
+/* MID128 reset flags, factory variant */
+#define OSP_FACTORY_KEEP_ROM    0x01
+#define OSP_FACTORY_CLR_XOCW    0x40
+
+/* MID214 hardware configuration */
+#define OSP_HW_TIME_TA          0x01
+#define OSP_HW_TIME_TA_DIR      0x02
+#define OSP_HW_FREQ_TA          0x04
+#define OSP_HW_FREQ_TA_METHOD   0x08
+#define OSP_HW_RTC_AVAILABLE    0x10
+#define OSP_HW_RTC_INTERNAL     0x20
+#define OSP_HW_COARSE_TIME_TA   0x40
+#define OSP_HW_REF_CLK          0x80
+
+static inline uint8_t *put_u8(uint8_t *p, uint8_t v)
+{
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t *put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *put_be24(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 16;
+    p[1] = v >> 8;
+    p[2] = v;
+    return p + 3;
+}
+
+static inline uint8_t *put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static inline uint8_t *put_be40(uint8_t *p, uint64_t v)
+{
+    p[0] = v >> 32;
+    return put_be32(p + 1, v);
+}
+
+static inline uint8_t *put_zero(uint8_t *p, size_t n)
+{
+    memset(p, 0, n);
+    return p + n;
+}
+
+static inline uint8_t *put_bytes(uint8_t *p, const void *src, size_t n)
+{
+    memcpy(p, src, n);
+    return p + n;
+}
+
+/* Initialize Data Source - MID128, flags are OSP_INIT_* or OSP_FACTORY_* */
+static inline size_t osp_build_init(uint8_t buf[OSP_MID128_LEN],
+        uint8_t channels, uint8_t flags)
+{
+    uint8_t *p = put_u8(buf, 128);
+    p = put_zero(p, 5*4 + 2);   /* ECEF, drift, TOW and week unused */
+    p = put_u8(p, channels);
+    p = put_u8(p, flags);
+    return p - buf;
+}
+
+/* Set Almanac - MID130, rows as received from MID14 */
+static inline size_t osp_build_almanac_set(uint8_t buf[OSP_MID130_LEN],
+        const void *rows)
+{
+    uint8_t *p = put_u8(buf, 130);
+    p = put_bytes(p, rows, OSP_MID130_LEN - 1);
+    return p - buf;
+}
+
+/* Poll Software Version - MID132 */
+static inline size_t osp_build_version_poll(uint8_t buf[OSP_MID132_LEN])
+{
+    uint8_t *p = put_u8(buf, 132);
+    p = put_u8(p, 0);
+    return p - buf;
+}
+
+/* Poll Almanac - MID146 */
+static inline size_t osp_build_almanac_poll(uint8_t buf[OSP_MID146_LEN])
+{
+    uint8_t *p = put_u8(buf, 146);
+    p = put_u8(p, 0);
+    return p - buf;
+}
+
+/* Poll Ephemeris - MID147, svid 0 polls all */
+static inline size_t osp_build_ephemeris_poll(uint8_t buf[OSP_MID147_LEN],
+        uint8_t svid)
+{
+    uint8_t *p = put_u8(buf, 147);
+    p = put_u8(p, svid);
+    p = put_u8(p, 0);
+    return p - buf;
+}
+
+/* Set Ephemeris - MID149, data as received from MID15 */
+static inline size_t osp_build_ephemeris_set(uint8_t buf[OSP_MID149_LEN],
+        const void *data)
+{
+    uint8_t *p = put_u8(buf, 149);
+    p = put_bytes(p, data, OSP_MID149_LEN - 1);
+    return p - buf;
+}
+
+/* Set Message Rate - MID166 */
+static inline size_t osp_build_msg_rate(uint8_t buf[OSP_MID166_LEN],
+        uint8_t mode, uint8_t mid, uint8_t rate)
+{
+    uint8_t *p = put_u8(buf, 166);
+    p = put_u8(p, mode);
+    p = put_u8(p, mid);
+    p = put_u8(p, rate);
+    p = put_zero(p, 4);
+    return p - buf;
+}
+
+/* Session Opening/Closing Request - MID213 */
+static inline size_t osp_build_session(uint8_t buf[OSP_MID213_LEN],
+        uint8_t sid, uint8_t request)
+{
+    uint8_t *p = put_u8(buf, 213);
+    p = put_u8(p, sid);
+    p = put_u8(p, request);
+    return p - buf;
+}
+
+/* Hardware Configuration Response - MID214, hw_config is OSP_HW_* */
+static inline size_t osp_build_hw_config(uint8_t buf[OSP_MID214_LEN],
+        uint8_t hw_config)
+{
+    uint8_t *p = put_u8(buf, 214);
+    p = put_u8(p, hw_config);
+    p = put_zero(p, 5);         /* nominal frequency */
+    p = put_u8(p, 0);           /* network enhancement */
+    return p - buf;
+}
+
+/* Uncertainty code K of 3GPP TS 23.032, r = 10*(1.1^K - 1) m, rounded up
+ * so receiver never searches narrower than error is */
+static inline uint8_t osp_uncertainty_code(uint32_t meters)
+{
+    double pow = 1.0;
+    uint8_t k = 0;
+    while (k < 127 && 10.0 * (pow - 1.0) < meters) {
+        pow *= 1.1;
+        k++;
+    }
+    return k;
+}
+
+/* Approximate MS Position Response - MID215, SID1, hor_err is uncertainty
+ * code, ver_err in m */
+static inline size_t osp_build_position(uint8_t buf[OSP_MID215_SID1_LEN],
+        int32_t lat, int32_t lon, int16_t alt, uint8_t hor_err,
+        uint16_t ver_err, bool alt_aiding)
+{
+    uint8_t *p = put_u8(buf, 215);
+    p = put_u8(p, 1);
+    p = put_be32(p, lat);
+    p = put_be32(p, lon);
+    p = put_be16(p, alt);
+    p = put_u8(p, hor_err);
+    p = put_be16(p, ver_err);
+    p = put_u8(p, alt_aiding);
+    return p - buf;
+}
+
+/* Time Transfer Response - MID215, SID2. gps_time is TOW in us, 40 bits,
+ * delta_utc in ms, 24 bits */
+static inline size_t osp_build_time(uint8_t buf[OSP_MID215_SID2_LEN],
+        uint8_t tt_type, uint16_t week, uint64_t gps_time,
+        uint32_t delta_utc, uint8_t accuracy)
+{
+    uint8_t *p = put_u8(buf, 215);
+    p = put_u8(p, 2);
+    p = put_u8(p, tt_type);
+    p = put_be16(p, week);
+    p = put_be40(p, gps_time);
+    p = put_be24(p, delta_utc);
+    p = put_u8(p, accuracy);
+    return p - buf;
+}
+
+/* Reject - MID216 */
+static inline size_t osp_build_reject(uint8_t buf[OSP_MID216_LEN],
+        uint8_t rmid, uint8_t rsid, uint8_t reason)
+{
+    uint8_t *p = put_u8(buf, 216);
+    p = put_u8(p, 2);
+    p = put_u8(p, rmid);
+    p = put_u8(p, rsid);
+    p = put_u8(p, reason);
+    return p - buf;
+}
+
+/* Power Mode Request - MID218, full power */
+static inline size_t osp_build_pwr_full(uint8_t buf[OSP_MID218_FULL_LEN])
+{
+    uint8_t *p = put_u8(buf, 218);
+    p = put_u8(p, PM_FULL_POWER);
+    return p - buf;
+}
+
+/* Power Mode Request - MID218, push-to-fix */
+static inline size_t osp_build_pwr_ptf(uint8_t buf[OSP_MID218_PTF_LEN],
+        uint32_t period, uint32_t m_search, uint32_t m_off)
+{
+    uint8_t *p = put_u8(buf, 218);
+    p = put_u8(p, PM_PTF);
+    p = put_be32(p, period);
+    p = put_be32(p, m_search);
+    p = put_be32(p, m_off);
+    return p - buf;
+}
+
+/* CW Configuration - MID220 */
+static inline size_t osp_build_cw(uint8_t buf[OSP_MID220_LEN], uint8_t mode)
+{
+    uint8_t *p = put_u8(buf, 220);
+    p = put_u8(p, 1);
+    p = put_u8(p, mode);
+    return p - buf;
+}
+
+/* MID232 */
+static inline size_t osp_build_mid232(uint8_t buf[OSP_MID232_LEN],
+        uint8_t sid, uint32_t svid_mask)
+{
+    uint8_t *p = put_u8(buf, 232);
+    p = put_u8(p, sid);
+    p = put_be32(p, svid_mask);
+    return p - buf;
+}
+
+#endif /* _OSP_BUILDER_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "osp-capture.h"
+#include "endian.h"
+
+#define RECORD_HEADER 12
+
+struct osp_capture {
+    int fd;
+
+    /* bytes [out, in) of ring are waiting for writer; bytes of record it
+     * writes, [start, end), are held until it is written whole */
+    uint8_t *ring;
+    size_t size;
+    uint64_t in;
+    uint64_t out;
+    uint64_t start;
+    uint64_t end;
+    uint64_t dropped;
+
+    bool failed;                /* write failed, records are dropped */
+    bool stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t signal;
+};
+
+struct osp_capture_reader {
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+};
+
+static void ring_put(osp_capture_t *cap, uint64_t at, const void *src, size_t len)
+{
+    size_t off = at % cap->size;
+    size_t first = cap->size - off < len ? cap->size - off : len;
+    memcpy(&cap->ring[off], src, first);
+    memcpy(cap->ring, (const uint8_t*)src + first, len - first);
+}
+
+static void ring_get(osp_capture_t *cap, uint64_t at, void *dst, size_t len)
+{
+    size_t off = at % cap->size;
+    size_t first = cap->size - off < len ? cap->size - off : len;
+    memcpy(dst, &cap->ring[off], first);
+    memcpy((uint8_t*)dst + first, cap->ring, len - first);
+}
+
+/* Ring position where record starting at given one ends */
+static uint64_t record_end(osp_capture_t *cap, uint64_t at)
+{
+    uint16_t len;
+    ring_get(cap, at + 8, &len, 2);
+    return at + RECORD_HEADER + le16toh(len);
+}
+
+static void encode_header(uint8_t *header, int dir,
+        const struct timespec *stamp, size_t length)
+{
+    uint64_t ns = htole64((uint64_t)stamp->tv_sec * 1000000000ull + stamp->tv_nsec);
+    uint16_t len = htole16(length);
+
+    memcpy(&header[0], &ns, 8);
+    memcpy(&header[8], &len, 2);
+    header[10] = dir;
+    header[11] = 0;
+}
+
+/* Offset past the last whole record of capture in fd, -1 if it is not one */
+static off_t whole_records(int fd, off_t size)
+{
+    uint8_t header[RECORD_HEADER];
+    off_t at = OSP_CAPTURE_MAGIC_LEN;
+    uint16_t len;
+
+    if (pread(fd, header, OSP_CAPTURE_MAGIC_LEN, 0) != OSP_CAPTURE_MAGIC_LEN
+            || memcmp(header, OSP_CAPTURE_MAGIC, OSP_CAPTURE_MAGIC_LEN)) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (size - at >= RECORD_HEADER) {
+        if (pread(fd, header, RECORD_HEADER, at) != RECORD_HEADER)
+            return -1;
+        memcpy(&len, &header[8], 2);
+        if (size - at - RECORD_HEADER < le16toh(len))
+            break;
+        at += RECORD_HEADER + le16toh(len);
+    }
+    return at;
+}
+
+/* Session record ties monotonic stamps of records following it to
+ * realtime clock */
+static int write_session(int fd)
+{
+    uint8_t record[RECORD_HEADER + 8];
+    struct timespec mono, real;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    encode_header(record, OSP_SESSION, &mono, 8);
+    ns = htole64((uint64_t)real.tv_sec * 1000000000ull + real.tv_nsec);
+    memcpy(&record[RECORD_HEADER], &ns, 8);
+    return write(fd, record, sizeof(record)) == sizeof(record) ? 0 : -1;
+}
+
+static void* writer_thread(void *arg)
+{
+    osp_capture_t *cap = arg;
+    uint64_t in, out, at;
+    size_t off, len;
+    ssize_t rv;
+    int err;
+
+    pthread_mutex_lock(&cap->lock);
+    for (;;) {
+        while (cap->in == cap->out && !cap->stop)
+            pthread_cond_wait(&cap->signal, &cap->lock);
+        if (cap->in == cap->out)
+            break;
+        if (cap->out == cap->end) {
+            cap->start = cap->out;
+            cap->end = record_end(cap, cap->out);
+        }
+        in = cap->in;
+        out = cap->out;
+        pthread_mutex_unlock(&cap->lock);
+
+        /* producers only touch free part of ring, no lock needed here */
+        off = out % cap->size;
+        len = in - out;
+        if (len > cap->size - off)
+            len = cap->size - off;
+        rv = write(cap->fd, &cap->ring[off], len);
+        err = errno;
+
+        pthread_mutex_lock(&cap->lock);
+        if (rv < 0 && err == EINTR)
+            continue;
+        if (rv < 0) {
+            /* Nothing more is written. File ends with record cut short,
+             * which reader takes for its end and next open cuts off. */
+            for (at = cap->start; at != cap->in; at = record_end(cap, at))
+                cap->dropped++;
+            cap->failed = true;
+            cap->out = cap->start = cap->end = cap->in;
+            continue;
+        }
+        cap->out += rv;
+        if (cap->out == cap->end)
+            cap->start = cap->out;
+    }
+    pthread_mutex_unlock(&cap->lock);
+    return NULL;
+}
+
+osp_capture_t* osp_capture_open(const char *path, size_t buffer)
+{
+    osp_capture_t *cap;
+    struct stat st;
+    off_t end = OSP_CAPTURE_MAGIC_LEN;
+
+    if (!(cap = calloc(1, sizeof(osp_capture_t))))
+        goto capture_nomem;
+    cap->fd = -1;
+    if (!(cap->ring = malloc(buffer)))
+        goto capture_nomem;
+    cap->size = buffer;
+    /* not appending, as torn record at the end is written over */
+    if ((cap->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        goto capture_error;
+    if (fstat(cap->fd, &st) < 0)
+        goto capture_error;
+    if (!st.st_size) {
+        if (write(cap->fd, OSP_CAPTURE_MAGIC, OSP_CAPTURE_MAGIC_LEN)
+                != OSP_CAPTURE_MAGIC_LEN)
+            goto capture_error;
+    } else if ((end = whole_records(cap->fd, st.st_size)) < 0
+            || ftruncate(cap->fd, end) < 0) {
+        goto capture_error;
+    }
+    if (lseek(cap->fd, end, SEEK_SET) < 0 || write_session(cap->fd) < 0)
+        goto capture_error;
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->signal, NULL);
+    if ((errno = pthread_create(&cap->writer, NULL, writer_thread, cap)))
+        goto capture_error;
+    return cap;
+
+capture_nomem:
+    errno = ENOMEM;
+capture_error:
+    if (cap) {
+        if (cap->fd >= 0)
+            close(cap->fd);
+        free(cap->ring);
+        free(cap);
+    }
+    return NULL;
+}
+
+void osp_capture_record(osp_capture_t *cap, int dir,
+        const struct timespec *stamp, const void *frame, size_t length)
+{
+    uint8_t header[RECORD_HEADER];
+
+    encode_header(header, dir, stamp, length);
+    pthread_mutex_lock(&cap->lock);
+    if (cap->failed || length > 0xFFFF
+            || cap->size - (cap->in - cap->start) < RECORD_HEADER + length) {
+        cap->dropped++;
+    } else {
+        ring_put(cap, cap->in, header, RECORD_HEADER);
+        ring_put(cap, cap->in + RECORD_HEADER, frame, length);
+        if (cap->in == cap->out)
+            pthread_cond_signal(&cap->signal);
+        cap->in += RECORD_HEADER + length;
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+uint64_t osp_capture_dropped(osp_capture_t *cap)
+{
+    uint64_t dropped;
+    pthread_mutex_lock(&cap->lock);
+    dropped = cap->dropped;
+    pthread_mutex_unlock(&cap->lock);
+    return dropped;
+}
+
+void osp_capture_close(osp_capture_t *cap)
+{
+    pthread_mutex_lock(&cap->lock);
+    cap->stop = true;
+    pthread_cond_signal(&cap->signal);
+    pthread_mutex_unlock(&cap->lock);
+    pthread_join(cap->writer, NULL);
+    close(cap->fd);
+    pthread_mutex_destroy(&cap->lock);
+    pthread_cond_destroy(&cap->signal);
+    free(cap->ring);
+    free(cap);
+}
+
+osp_capture_reader_t* osp_capture_reader_open(const char *path)
+{
+    osp_capture_reader_t *reader;
+    struct stat st;
+
+    if (!(reader = calloc(1, sizeof(osp_capture_reader_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((reader->fd = open(path, O_RDONLY)) < 0)
+        goto reader_error;
+    if (fstat(reader->fd, &st) < 0)
+        goto reader_error;
+    reader->size = st.st_size;
+    if (reader->size < OSP_CAPTURE_MAGIC_LEN) {
+        errno = EINVAL;
+        goto reader_error;
+    }
+    reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (reader->data == MAP_FAILED)
+        goto reader_error;
+    madvise((void*)reader->data, reader->size, MADV_SEQUENTIAL);
+    if (memcmp(reader->data, OSP_CAPTURE_MAGIC, OSP_CAPTURE_MAGIC_LEN)) {
+        munmap((void*)reader->data, reader->size);
+        errno = EINVAL;
+        goto reader_error;
+    }
+    reader->pos = OSP_CAPTURE_MAGIC_LEN;
+    return reader;
+
+reader_error:
+    if (reader->fd >= 0)
+        close(reader->fd);
+    free(reader);
+    return NULL;
+}
+
+int osp_capture_next(osp_capture_reader_t *reader, osp_capture_record_t *rec)
+{
+    const uint8_t *p = &reader->data[reader->pos];
+    size_t left = reader->size - reader->pos;
+    uint64_t ns;
+    uint16_t len;
+
+    if (left < RECORD_HEADER)
+        return 0;
+    memcpy(&ns, &p[0], 8);
+    memcpy(&len, &p[8], 2);
+    len = le16toh(len);
+    if (left - RECORD_HEADER < len)
+        return 0;
+    rec->stamp = le64toh(ns);
+    rec->length = len;
+    rec->dir = p[10];
+    rec->data = &p[RECORD_HEADER];
+    reader->pos += RECORD_HEADER + len;
+    return 1;
+}
+
+void osp_capture_reader_close(osp_capture_reader_t *reader)
+{
+    munmap((void*)reader->data, reader->size);
+    close(reader->fd);
+    free(reader);
+}
+
+/* vim: set ts=4 sw=4 et: */
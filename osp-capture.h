@@ -0,0 +1,51 @@
+#ifndef _OSP_CAPTURE_H
+#define _OSP_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Capture file is "OSPCAP" magic followed by two bytes of version and then
+ * records: 8 bytes of CLOCK_MONOTONIC time in ns, 2 bytes of length,
+ * direction, reserved byte (all little endian), then the frame payload.
+ * Every open of the file starts a session with OSP_SESSION record, whose
+ * payload is 8 bytes of CLOCK_REALTIME in ns at its stamp. Records of one
+ * session share one CLOCK_MONOTONIC timeline, those of different sessions
+ * may come from different boots. */
+#define OSP_CAPTURE_MAGIC "OSPCAP\0\1"
+#define OSP_CAPTURE_MAGIC_LEN 8
+
+enum { OSP_INCOMING, OSP_OUTGOING, OSP_SESSION };
+
+typedef struct osp_capture osp_capture_t;
+typedef struct osp_capture_reader osp_capture_reader_t;
+
+typedef struct {
+    int dir;                    /* OSP_INCOMING or OSP_OUTGOING */
+    uint64_t stamp;             /* CLOCK_MONOTONIC in ns */
+    const uint8_t *data;        /* payload, starting with MID */
+    size_t length;
+} osp_capture_record_t;
+
+/* Open file for appending records in a new session. Record cut short by
+ * crash at the end of existing capture is cut off first; file which is not
+ * a capture fails with EINVAL. Records are queued in a buffer of given
+ * size and written by a background thread; when it is full they are
+ * dropped and counted, recording never blocks. Once a write fails, nothing
+ * more is written and all records are dropped. */
+osp_capture_t* osp_capture_open(const char *path, size_t buffer);
+void osp_capture_record(osp_capture_t *cap, int dir,
+        const struct timespec *stamp, const void *frame, size_t length);
+uint64_t osp_capture_dropped(osp_capture_t *cap);
+/* Flush queued records and close file */
+void osp_capture_close(osp_capture_t *cap);
+
+osp_capture_reader_t* osp_capture_reader_open(const char *path);
+/* Returns 1 with next record or 0 at the end; a record cut short by crash
+ * ends the capture. Record data stays valid until reader is closed. */
+int osp_capture_next(osp_capture_reader_t *reader, osp_capture_record_t *rec);
+void osp_capture_reader_close(osp_capture_reader_t *reader);
+
+#endif /* _OSP_CAPTURE_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,180 @@
+#include <string.h>
+#include "osp-checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define HAVE_X86_KERNELS 1
+#   include <immintrin.h>
+#endif
+
+/* Checksum is a plain sum modulo 2^15, so kernels accumulate in wide lanes
+ * and fold with 0x7FFF once, at the end. */
+
+typedef struct {
+    const char *name;
+    uint32_t (*sum)(const uint8_t *src, size_t len);
+    uint32_t (*copy)(uint8_t *dst, const uint8_t *src, size_t len);
+} kernel_t;
+
+static uint32_t sum_bytes(const uint8_t *src, size_t len)
+{
+    uint32_t sum = 0;
+    while (len--)
+        sum += *src++;
+    return sum;
+}
+
+static uint32_t copy_bytes(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint32_t sum = 0;
+    while (len--)
+        sum += (*dst++ = *src++);
+    return sum;
+}
+
+/* Portable SWAR: eight bytes per step, summed in four 16-bit lanes. A lane
+ * gains at most 2*255 per step, so lanes are flushed every 128 steps. */
+#define SWAR_LOW 0x00FF00FF00FF00FFull
+#define SWAR_STEPS 128
+
+static inline uint32_t swar_fold(uint64_t acc)
+{
+    return (acc & 0xFFFF) + ((acc >> 16) & 0xFFFF)
+         + ((acc >> 32) & 0xFFFF) + (acc >> 48);
+}
+
+static uint32_t sum_swar(const uint8_t *src, size_t len)
+{
+    uint32_t sum = 0;
+    while (len >= 8) {
+        uint64_t acc = 0, w;
+        int steps = SWAR_STEPS;
+        for (; len >= 8 && steps; len -= 8, src += 8, steps--) {
+            memcpy(&w, src, 8);
+            acc += (w & SWAR_LOW) + ((w >> 8) & SWAR_LOW);
+        }
+        sum += swar_fold(acc);
+    }
+    return sum + sum_bytes(src, len);
+}
+
+static uint32_t copy_swar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint32_t sum = 0;
+    while (len >= 8) {
+        uint64_t acc = 0, w;
+        int steps = SWAR_STEPS;
+        for (; len >= 8 && steps; len -= 8, src += 8, dst += 8, steps--) {
+            memcpy(&w, src, 8);
+            memcpy(dst, &w, 8);
+            acc += (w & SWAR_LOW) + ((w >> 8) & SWAR_LOW);
+        }
+        sum += swar_fold(acc);
+    }
+    return sum + copy_bytes(dst, src, len);
+}
+
+static const kernel_t generic = { "swar64", sum_swar, copy_swar };
+
+#if HAVE_X86_KERNELS
+/* psadbw against zero sums groups of eight bytes into 64-bit lanes, which
+ * cannot overflow for any payload length. */
+__attribute__((target("sse2")))
+static uint32_t sum_sse2(const uint8_t *src, size_t len)
+{
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    for (; len >= 16; len -= 16, src += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+    return (uint32_t)_mm_cvtsi128_si32(acc) + sum_bytes(src, len);
+}
+
+__attribute__((target("sse2")))
+static uint32_t copy_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    for (; len >= 16; len -= 16, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, v);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+    return (uint32_t)_mm_cvtsi128_si32(acc) + copy_bytes(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t sum_avx2(const uint8_t *src, size_t len)
+{
+    __m256i acc = _mm256_setzero_si256();
+    const __m256i zero = _mm256_setzero_si256();
+    __m128i half;
+    for (; len >= 32; len -= 32, src += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)src);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                         _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+    return (uint32_t)_mm_cvtsi128_si32(half) + sum_sse2(src, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t copy_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    __m256i acc = _mm256_setzero_si256();
+    const __m256i zero = _mm256_setzero_si256();
+    __m128i half;
+    for (; len >= 32; len -= 32, src += 32, dst += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)src);
+        _mm256_storeu_si256((__m256i*)dst, v);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                         _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+    return (uint32_t)_mm_cvtsi128_si32(half) + copy_sse2(dst, src, len);
+}
+
+static const kernel_t sse2 = { "sse2", sum_sse2, copy_sse2 };
+static const kernel_t avx2 = { "avx2", sum_avx2, copy_avx2 };
+#endif
+
+static const kernel_t *kernel;
+
+static const kernel_t* select_kernel(void)
+{
+    const kernel_t *k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (k)
+        return k;
+    k = &generic;
+#if HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        k = &avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        k = &sse2;
+#endif
+    /* racing callers pick the same kernel, so plain store is enough */
+    __atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+    return k;
+}
+
+uint16_t osp_checksum(const uint8_t *payload, size_t len)
+{
+    return select_kernel()->sum(payload, len) & 0x7FFF;
+}
+
+uint16_t osp_checksum_copy(uint8_t *dst, const uint8_t *payload, size_t len)
+{
+    return select_kernel()->copy(dst, payload, len) & 0x7FFF;
+}
+
+const char* osp_checksum_kernel(void)
+{
+    return select_kernel()->name;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,19 @@
+#ifndef _OSP_CHECKSUM_H
+#define _OSP_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 15-bit sum of payload bytes, as carried in OSP frame trailer. Kernel
+ * (generic, SSE2 or AVX2) is picked on first call depending on CPU. */
+uint16_t osp_checksum(const uint8_t *payload, size_t len);
+
+/* As osp_checksum(), copying payload to dst in the same pass */
+uint16_t osp_checksum_copy(uint8_t *dst, const uint8_t *payload, size_t len);
+
+/* Name of kernel in use */
+const char* osp_checksum_kernel(void);
+
+#endif /* _OSP_CHECKSUM_H */
+
+/* vim: set ts=4 sw=4 et: */
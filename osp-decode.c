@@ -0,0 +1,408 @@
+#include <errno.h>
+#include <string.h>
+#include "osp-decode.h"
+
+/* Decoders walk payload in wire order with a cursor, so every field is read
+ * exactly once, whatever its alignment. Length is already checked against
+ * minimum of MID when decoder is called. */
+
+static inline uint8_t u8(const uint8_t **p)
+{
+    return *(*p)++;
+}
+
+static inline uint16_t u16(const uint8_t **p)
+{
+    uint16_t v = ((*p)[0] << 8) | (*p)[1];
+    *p += 2;
+    return v;
+}
+
+static inline uint32_t u32(const uint8_t **p)
+{
+    uint32_t v = ((uint32_t)(*p)[0] << 24) | ((uint32_t)(*p)[1] << 16)
+               | ((uint32_t)(*p)[2] << 8) | (*p)[3];
+    *p += 4;
+    return v;
+}
+
+static inline float f32(const uint8_t **p)
+{
+    uint32_t v = u32(p);
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+/* MID28 doubles come as two big endian words, less significant first */
+static inline double f64(const uint8_t **p)
+{
+    uint64_t v = u32(p);
+    double d;
+    v |= (uint64_t)u32(p) << 32;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline void bytes(const uint8_t **p, void *dst, size_t len)
+{
+    memcpy(dst, *p, len);
+    *p += len;
+}
+
+static int decode_mid2(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid2_t *m = &msg->mid2;
+    uint8_t mode1;
+    m->x = u32(&p);
+    m->y = u32(&p);
+    m->z = u32(&p);
+    m->vx = u16(&p);
+    m->vy = u16(&p);
+    m->vz = u16(&p);
+    mode1 = u8(&p);
+    m->pmode = mode1 & 0x07;
+    m->tpmode = mode1 & 0x08;
+    m->altmode = (mode1 >> 4) & 0x03;
+    m->dop_mask = mode1 & 0x40;
+    m->dgps = mode1 & 0x80;
+    m->hdop = u8(&p);
+    m->mode2 = u8(&p);
+    m->gps_week = u16(&p);
+    m->gps_tow = u32(&p);
+    m->svs_in_fix = u8(&p);
+    bytes(&p, m->ch_prn, sizeof(m->ch_prn));
+    return 0;
+}
+
+static int decode_mid4(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid4_t *m = &msg->mid4;
+    int i;
+    m->gps_week = u16(&p);
+    m->gps_tow = u32(&p);
+    m->chans = u8(&p);
+    if (m->chans > OSP_CHANNELS || len < 7 + m->chans * 15u)
+        return -1;
+    for (i = 0; i < m->chans; i++) {
+        m->channel[i].svid = u8(&p);
+        m->channel[i].azimuth = u8(&p);
+        m->channel[i].elevation = u8(&p);
+        m->channel[i].state = u16(&p);
+        bytes(&p, m->channel[i].cn0, sizeof(m->channel[i].cn0));
+    }
+    return 0;
+}
+
+static int decode_mid6(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    size_t n = len < sizeof(struct mid6) ? len : sizeof(struct mid6);
+    memcpy(msg->mid6.version, p, n);
+    msg->mid6.version[n] = '\0';
+    return 0;
+}
+
+static int decode_mid7(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid7_t *m = &msg->mid7;
+    m->gps_week = u16(&p);
+    m->gps_tow = u32(&p);
+    m->svs = u8(&p);
+    m->clock_drift = u32(&p);
+    m->clock_bias = u32(&p);
+    m->gps_time = u32(&p);
+    return 0;
+}
+
+static int decode_mid11(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    /* sid byte is sent only by commands which have one */
+    msg->mid11.echo_mid = u8(&p);
+    msg->mid11.echo_sid = len > 1 ? u8(&p) : 0;
+    return 0;
+}
+
+static int decode_mid13(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid13_t *m = &msg->mid13;
+    int i;
+    m->svs = u8(&p);
+    if (m->svs > 13 || len < 1 + m->svs * 5u)
+        return -1;
+    for (i = 0; i < m->svs; i++) {
+        m->ch[i].svid = u8(&p);
+        m->ch[i].azimuth = u16(&p);
+        m->ch[i].elevation = u16(&p);
+    }
+    return 0;
+}
+
+static int decode_mid14(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid14_t *m = &msg->mid14;
+    uint16_t word;
+    int i;
+    m->svid = u8(&p);
+    word = u16(&p);
+    m->week = word >> 6;
+    m->status = word & 0x3F;
+    for (i = 0; i < 12; i++)
+        m->data[i] = u16(&p);
+    m->checksum = u16(&p);
+    return 0;
+}
+
+static int decode_mid15(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    int i;
+    msg->mid15.svid = u8(&p);
+    for (i = 0; i < 45; i++)
+        msg->mid15.data[i] = u16(&p);
+    return 0;
+}
+
+static int decode_mid18(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    msg->mid18.send_indicator = u8(&p);
+    return 0;
+}
+
+static int decode_mid28(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid28_t *m = &msg->mid28;
+    m->channel = u8(&p);
+    m->time_tag = u32(&p);
+    m->svid = u8(&p);
+    m->gps_sw_time = f64(&p);
+    m->pseudorange = f64(&p);
+    m->carrier_freq = f32(&p);
+    m->carrier_phase = f64(&p);
+    m->time_in_track = u16(&p);
+    m->sync_flags = u8(&p);
+    bytes(&p, m->cn0, sizeof(m->cn0));
+    m->delta_range_interval = u16(&p);
+    m->mean_delta_range_time = u16(&p);
+    m->extrapolation_time = u16(&p);
+    m->phase_error_count = u8(&p);
+    m->low_power_count = u8(&p);
+    return 0;
+}
+
+static int decode_mid29(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid29_t *m = &msg->mid29;
+    m->svid = u16(&p);
+    m->iod = u16(&p);
+    m->source = u8(&p);
+    m->pseudorange_correction = f32(&p);
+    m->pseudorange_rate_correction = f32(&p);
+    m->correction_age = f32(&p);
+    return 0;
+}
+
+static int decode_mid41(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid41_t *m = &msg->mid41;
+    m->nav_valid = u16(&p);
+    m->nav_type = u16(&p);
+    m->extended_week_no = u16(&p);
+    m->tow = u32(&p);
+    m->utc.year = u16(&p);
+    m->utc.month = u8(&p);
+    m->utc.day = u8(&p);
+    m->utc.hour = u8(&p);
+    m->utc.minute = u8(&p);
+    m->utc.second = u16(&p);
+    m->satellite_id_list = u32(&p);
+    m->latitude = u32(&p);
+    m->longitude = u32(&p);
+    m->altitude_ellipsoid = u32(&p);
+    m->altitude_msl = u32(&p);
+    m->map_datum = u8(&p);
+    m->speed_over_ground = u16(&p);
+    m->course_over_ground = u16(&p);
+    m->magnetic_variation = u16(&p);
+    m->climb_rate = u16(&p);
+    m->heading_rate = u16(&p);
+    m->est_h_pos_error = u32(&p);
+    m->est_v_pos_error = u32(&p);
+    m->est_time_error = u32(&p);
+    m->est_h_vel_error = u16(&p);
+    m->clock_bias = u32(&p);
+    m->clock_bias_error = u32(&p);
+    m->clock_drift = u32(&p);
+    m->clock_drift_error = u32(&p);
+    m->distance = u32(&p);
+    m->distance_error = u16(&p);
+    m->heading_error = u16(&p);
+    m->svs_in_fix = u8(&p);
+    m->hdop = u8(&p);
+    m->add_mode_info = u8(&p);
+    return 0;
+}
+
+static int decode_mid56(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid56_t *m = &msg->mid56;
+    int i;
+    m->sid = u8(&p);
+    switch (m->sid) {
+        case 3:
+            if (len < 1 + 12 * 8)
+                return -1;
+            for (i = 0; i < 12; i++) {
+                m->sid3.eph[i].svid = u8(&p);
+                m->sid3.eph[i].source = u8(&p);
+                m->sid3.eph[i].week = u16(&p);
+                m->sid3.eph[i].toe = u16(&p);
+                m->sid3.eph[i].integrity = u8(&p);
+                m->sid3.eph[i].age = u8(&p);
+            }
+            break;
+        case 5:
+            if (len < 1 + 6)
+                return -1;
+            m->sid5.channel = u8(&p);
+            m->sid5.svid = u8(&p);
+            m->sid5.word = u32(&p);
+            break;
+        case 42:
+            if (len < 1 + 14 + 16 * 2)
+                return -1;
+            m->sid42.sif_state = u8(&p);
+            m->sid42.cgee_state = u8(&p);
+            m->sid42.sif_aiding_type = u8(&p);
+            m->sid42.sgee_dwnld_in_progress = u8(&p);
+            m->sid42.cgee_time_left = u32(&p);
+            m->sid42.cgee_pending_mask = u32(&p);
+            m->sid42.svid_cgee_in_progress = u8(&p);
+            m->sid42.sgee_age_validity = u8(&p);
+            for (i = 0; i < 16; i++)
+                m->sid42.cgee_age_validity[i] = u16(&p);
+            break;
+    }
+    return 0;
+}
+
+static int decode_mid70(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    osp_mid70_t *m = &msg->mid70;
+    int i;
+    m->sid = u8(&p);
+    m->gps_time_flag = u8(&p);
+    m->extd_gps_week = u16(&p);
+    m->gps_tow = u32(&p);
+    m->eph_status_type = u8(&p);
+    m->gps_t_toe_limit = u8(&p);
+    m->num_svs = u8(&p);
+    if (m->num_svs > OSP_MID70_SVS || len < 11 + m->num_svs * 10u)
+        return -1;
+    for (i = 0; i < m->num_svs; i++) {
+        m->svs[i].satid = u8(&p);
+        m->svs[i].sat_info_flag = u8(&p);
+        m->svs[i].gps_week = u16(&p);
+        m->svs[i].gps_toe = u16(&p);
+        m->svs[i].iode = u8(&p);
+        m->svs[i].azimuth = u16(&p);
+        m->svs[i].elevation = u8(&p);
+    }
+    return 0;
+}
+
+static int decode_empty(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    return 0;
+}
+
+static int decode_mid73(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    uint8_t flags;
+    msg->mid73.sid = u8(&p);
+    flags = u8(&p);
+    msg->mid73.multiple_request = flags & 0x01;
+    msg->mid73.periodic = flags & 0x02;
+    msg->mid73.turn_off_ref_clock = flags & 0x04;
+    return 0;
+}
+
+static int decode_mid74(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    msg->mid74.sid = u8(&p);
+    msg->mid74.status = u8(&p);
+    return 0;
+}
+
+static int decode_mid75(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    msg->mid75.sid = u8(&p);
+    msg->mid75.echo_mid = u8(&p);
+    msg->mid75.echo_sid = u8(&p);
+    msg->mid75.ack = u8(&p);
+    return 0;
+}
+
+static int decode_mid90(const uint8_t *p, size_t len, osp_msg_t *msg)
+{
+    msg->mid90.sid = u8(&p);
+    msg->mid90.error_code = u8(&p);
+    return 0;
+}
+
+typedef int (*decode_f)(const uint8_t *p, size_t len, osp_msg_t *msg);
+
+/* Shortest body (without MID) for which decoder may be called, and
+ * whether its first byte is SID */
+static const struct {
+    size_t min;
+    decode_f decode;
+    bool sid;
+} decoders[256] = {
+    [2] = { sizeof(struct mid2), decode_mid2 },
+    [4] = { 7, decode_mid4 },
+    [6] = { 0, decode_mid6 },
+    [7] = { sizeof(struct mid7), decode_mid7 },
+    [11] = { 1, decode_mid11 },
+    [12] = { 1, decode_mid11 },
+    [13] = { 1, decode_mid13 },
+    [14] = { sizeof(struct mid14), decode_mid14 },
+    [15] = { sizeof(struct mid15), decode_mid15 },
+    [18] = { sizeof(struct mid18), decode_mid18 },
+    [28] = { sizeof(struct mid28), decode_mid28 },
+    [29] = { 2 + 2 + 1 + 3 * 4, decode_mid29 },
+    [41] = { sizeof(struct mid41), decode_mid41 },
+    [56] = { 1, decode_mid56, true },
+    [70] = { 11, decode_mid70, true },
+    [71] = { 0, decode_empty },
+    [73] = { sizeof(struct mid73), decode_mid73, true },
+    [74] = { sizeof(struct mid74), decode_mid74, true },
+    [75] = { 4, decode_mid75, true },
+    [90] = { sizeof(struct mid90), decode_mid90, true },
+};
+
+bool osp_decodable(uint8_t mid)
+{
+    return decoders[mid].decode != NULL;
+}
+
+bool osp_has_sid(uint8_t mid)
+{
+    return decoders[mid].sid;
+}
+
+int osp_decode(const osp_frame_t *frame, size_t length, osp_msg_t *msg)
+{
+    uint8_t mid = frame->mid;
+    if (!decoders[mid].decode) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (length < 1 || length - 1 < decoders[mid].min ||
+            decoders[mid].decode((const uint8_t*)frame + 1, length - 1, msg)) {
+        errno = EINVAL;
+        return -1;
+    }
+    msg->mid = mid;
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,295 @@
+#ifndef _OSP_DECODE_H
+#define _OSP_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osp-protocol.h"
+
+/* Host-endian, naturally aligned counterparts of incoming messages from
+ * osp-protocol.h. Scaling of values is left as sent by the receiver and
+ * noted next to the field. Wire bitfields are unpacked into plain fields. */
+
+#define OSP_CHANNELS 12
+
+/* Measure Navigation Data Out - MID2 */
+typedef struct {
+    int32_t x, y, z;            /* ECEF position, m */
+    int16_t vx, vy, vz;         /* ECEF velocity, m/s x8 */
+    uint8_t pmode;              /* mode 1 */
+    bool tpmode;
+    uint8_t altmode;
+    bool dop_mask;
+    bool dgps;
+    uint8_t hdop;               /* x5 */
+    uint8_t mode2;
+    uint16_t gps_week;
+    uint32_t gps_tow;           /* s x100 */
+    uint8_t svs_in_fix;
+    uint8_t ch_prn[OSP_CHANNELS];
+} osp_mid2_t;
+
+/* Measured Tracker Data Out - MID4, channel state bits */
+#define OSP_CH_ACQUISITION      0x0001
+#define OSP_CH_CARRIER_PHASE    0x0002
+#define OSP_CH_BIT_SYNC         0x0004
+#define OSP_CH_SUBFRAME_SYNC    0x0008
+#define OSP_CH_CARRIER_PULLIN   0x0010
+#define OSP_CH_CODE_LOCKED      0x0020
+#define OSP_CH_EPHEMERIS        0x0080
+
+typedef struct {
+    uint16_t gps_week;
+    uint32_t gps_tow;           /* s x100 */
+    uint8_t chans;
+    struct {
+        uint8_t svid;
+        uint8_t azimuth;        /* deg x2/3 */
+        uint8_t elevation;      /* deg x2 */
+        uint16_t state;         /* OSP_CH_* */
+        uint8_t cn0[10];        /* dB-Hz */
+    } channel[OSP_CHANNELS];
+} osp_mid4_t;
+
+/* Software Version String - MID6 */
+typedef struct {
+    char version[sizeof(struct mid6) + 1];
+} osp_mid6_t;
+
+/* Clock Status Data - MID7 */
+typedef struct {
+    uint16_t gps_week;
+    uint32_t gps_tow;           /* s x100 */
+    uint8_t svs;
+    uint32_t clock_drift;       /* Hz */
+    uint32_t clock_bias;        /* ns */
+    uint32_t gps_time;          /* ms */
+} osp_mid7_t;
+
+/* Command Acknowledgment - MID11, Negative Acknowledgment - MID12 */
+typedef struct {
+    uint8_t echo_mid;
+    uint8_t echo_sid;
+} osp_mid11_t, osp_mid12_t;
+
+/* Visible List - MID13 */
+typedef struct {
+    uint8_t svs;
+    struct {
+        uint8_t svid;
+        int16_t azimuth;        /* deg */
+        int16_t elevation;      /* deg */
+    } ch[13];
+} osp_mid13_t;
+
+/* Almanac Data - MID14 */
+typedef struct {
+    uint8_t svid;
+    uint16_t week;
+    uint8_t status;
+    uint16_t data[12];
+    uint16_t checksum;
+} osp_mid14_t;
+
+/* Ephemeris Data - MID15 */
+typedef struct {
+    uint8_t svid;
+    uint16_t data[45];
+} osp_mid15_t;
+
+/* OkToSend - MID18 */
+typedef struct {
+    uint8_t send_indicator;     /* mid18_send_indicator */
+} osp_mid18_t;
+
+/* Navigation Library Measurement Data - MID28 */
+typedef struct {
+    uint8_t channel;
+    uint32_t time_tag;          /* ms */
+    uint8_t svid;
+    double gps_sw_time;         /* s */
+    double pseudorange;         /* m */
+    float carrier_freq;         /* m/s */
+    double carrier_phase;       /* m */
+    uint16_t time_in_track;     /* ms */
+    uint8_t sync_flags;
+    uint8_t cn0[10];            /* dB-Hz */
+    uint16_t delta_range_interval;  /* ms */
+    uint16_t mean_delta_range_time; /* ms */
+    int16_t extrapolation_time; /* ms */
+    uint8_t phase_error_count;
+    uint8_t low_power_count;
+} osp_mid28_t;
+
+/* Navigation Library DGPS Data - MID29 */
+typedef struct {
+    int16_t svid;
+    int16_t iod;
+    uint8_t source;
+    float pseudorange_correction;       /* m */
+    float pseudorange_rate_correction;  /* m/s */
+    float correction_age;               /* s */
+} osp_mid29_t;
+
+/* Geodetic Navigation Data - MID41 */
+typedef struct {
+    uint16_t nav_valid;
+    uint16_t nav_type;
+    uint16_t extended_week_no;
+    uint32_t tow;               /* ms */
+    struct {
+        uint16_t year;
+        uint8_t month;
+        uint8_t day;
+        uint8_t hour;
+        uint8_t minute;
+        uint16_t second;        /* ms */
+    } utc;
+    uint32_t satellite_id_list;
+    int32_t latitude;           /* deg x10^7 */
+    int32_t longitude;          /* deg x10^7 */
+    int32_t altitude_ellipsoid; /* cm */
+    int32_t altitude_msl;       /* cm */
+    uint8_t map_datum;
+    uint16_t speed_over_ground; /* cm/s */
+    uint16_t course_over_ground;/* deg x100 */
+    int16_t magnetic_variation;
+    int16_t climb_rate;         /* cm/s */
+    int16_t heading_rate;       /* deg/s x100 */
+    uint32_t est_h_pos_error;   /* cm */
+    uint32_t est_v_pos_error;   /* cm */
+    uint32_t est_time_error;    /* s x100 */
+    uint16_t est_h_vel_error;   /* cm/s */
+    uint32_t clock_bias;        /* m x100 */
+    uint32_t clock_bias_error;  /* m x100 */
+    int32_t clock_drift;        /* m/s x100 */
+    uint32_t clock_drift_error; /* m/s x100 */
+    uint32_t distance;          /* m */
+    uint16_t distance_error;    /* m */
+    uint16_t heading_error;     /* deg x100 */
+    uint8_t svs_in_fix;
+    uint8_t hdop;               /* x5 */
+    uint8_t add_mode_info;
+} osp_mid41_t;
+
+/* Extended Ephemeris Data - MID56 */
+typedef struct {
+    uint8_t sid;
+    union {
+        struct {
+            struct {
+                uint8_t svid;
+                uint8_t source;
+                uint16_t week;
+                uint16_t toe;
+                uint8_t integrity;
+                uint8_t age;
+            } eph[12];
+        } sid3;
+        struct {
+            uint8_t channel;
+            uint8_t svid;
+            uint32_t word;
+        } sid5;
+        struct {
+            uint8_t sif_state;
+            uint8_t cgee_state;
+            uint8_t sif_aiding_type;
+            uint8_t sgee_dwnld_in_progress;
+            uint32_t cgee_time_left;
+            uint32_t cgee_pending_mask;
+            uint8_t svid_cgee_in_progress;
+            uint8_t sgee_age_validity;
+            uint16_t cgee_age_validity[16];
+        } sid42;
+    };
+} osp_mid56_t;
+
+/* Ephemeris Status Response - MID70 */
+#define OSP_MID70_SVS 32
+
+typedef struct {
+    uint8_t sid;
+    uint8_t gps_time_flag;
+    uint16_t extd_gps_week;
+    uint32_t gps_tow;
+    uint8_t eph_status_type;
+    uint8_t gps_t_toe_limit;
+    uint8_t num_svs;
+    struct {
+        uint8_t satid;
+        uint8_t sat_info_flag;
+        uint16_t gps_week;
+        uint16_t gps_toe;
+        uint8_t iode;
+        uint16_t azimuth;
+        uint8_t elevation;
+    } svs[OSP_MID70_SVS];
+} osp_mid70_t;
+
+/* Transfer Request - MID73 */
+typedef struct {
+    uint8_t sid;                /* mid73_transfer_type */
+    bool multiple_request;
+    bool periodic;
+    bool turn_off_ref_clock;
+} osp_mid73_t;
+
+/* Session Opening/Closing Response - MID74 */
+typedef struct {
+    uint8_t sid;
+    uint8_t status;             /* mid74_status */
+} osp_mid74_t;
+
+/* ACK/NACK/ERROR Notification - MID75 */
+typedef struct {
+    uint8_t sid;
+    uint8_t echo_mid;
+    uint8_t echo_sid;
+    uint8_t ack;
+} osp_mid75_t;
+
+/* Power Mode Response - MID90 */
+typedef struct {
+    uint8_t sid;                /* mid90_sid */
+    uint8_t error_code;         /* mid90_error_code */
+} osp_mid90_t;
+
+typedef struct {
+    uint8_t mid;
+    union {
+        osp_mid2_t mid2;
+        osp_mid4_t mid4;
+        osp_mid6_t mid6;
+        osp_mid7_t mid7;
+        osp_mid11_t mid11;
+        osp_mid12_t mid12;
+        osp_mid13_t mid13;
+        osp_mid14_t mid14;
+        osp_mid15_t mid15;
+        osp_mid18_t mid18;
+        osp_mid28_t mid28;
+        osp_mid29_t mid29;
+        osp_mid41_t mid41;
+        osp_mid56_t mid56;
+        osp_mid70_t mid70;
+        osp_mid73_t mid73;
+        osp_mid74_t mid74;
+        osp_mid75_t mid75;
+        osp_mid90_t mid90;
+    };
+} osp_msg_t;
+
+/* True if there is decoder for mid */
+bool osp_decodable(uint8_t mid);
+/* Message of decodable mid starts with SID */
+bool osp_has_sid(uint8_t mid);
+
+/* Convert frame into msg in one pass. Returns 0, or -1 with errno set to
+ * ENOTSUP for MID without decoder and EINVAL if length does not fit MID. */
+int osp_decode(const osp_frame_t *frame, size_t length, osp_msg_t *msg);
+
+#endif /* _OSP_DECODE_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "osp-framer.h"
+#include "osp-checksum.h"
+
+static const uint8_t HEADER[] = {0xa0, 0xa2};
+static const uint8_t TAIL[] = {0xb0, 0xb3};
+
+#define NMEA_START '$'
+/* '$', up to 79 characters, CR and LF */
+#define NMEA_MAX_SENTENCE 82
+
+#define RX_BUFFER_SIZE (2 * (OSP_MAX_PAYLOAD + OSP_FRAME_OVERHEAD))
+
+#define NOT_STAMPED ((size_t)-1)
+
+/* Statistics are written by feeding thread only, so a relaxed store is
+ * enough to keep them untorn for other threads, without locked add. */
+#define count(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+struct osp_framer {
+    /* receive buffer. Bytes [head, tail) are not consumed yet */
+    uint8_t rx[RX_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+
+    /* time of last commit and arrival of frame starting at stamped */
+    osp_stamp_t last_read;
+    osp_stamp_t arrival;
+    size_t stamped;
+    struct timespec previous;   /* arrival of last valid frame */
+
+    /* length of frame found at head */
+    size_t length;
+
+    /* NMEA sentences interleaved with frames */
+    osp_nmea_f nmea;
+    void *nmea_arg;
+    int protocol;
+
+    osp_transport_stats_t stats;
+};
+
+enum { FOUND_NONE, FOUND_OSP, FOUND_NMEA };
+
+/* Move head to the first OSP header or NMEA '$' in buffer. If there is
+ * none, a trailing 0xa0 is kept as it may be completed by the next read. */
+static int scan(osp_framer_t *fr)
+{
+    size_t from = fr->head;
+    uint8_t *start = &fr->rx[fr->head];
+    uint8_t *end = &fr->rx[fr->tail];
+    uint8_t *p = start;
+    uint8_t *nmea;
+    int found = FOUND_NONE;
+
+    while ((p = memchr(p, HEADER[0], end - p)) != NULL) {
+        if (p + 1 == end)
+            break;
+        if (p[1] == HEADER[1]) {
+            found = FOUND_OSP;
+            break;
+        }
+        p++;
+    }
+    if (!p)
+        p = end;
+    /* sentence is looked for only in bytes preceding binary header */
+    if ((nmea = memchr(start, NMEA_START, p - start)) != NULL) {
+        p = nmea;
+        found = FOUND_NMEA;
+    }
+    fr->head = p - fr->rx;
+    count(fr->stats.skipped, fr->head - from);
+    /* header is seen first time right after read delivering it */
+    if (found != FOUND_NONE && fr->stamped != fr->head) {
+        fr->stamped = fr->head;
+        fr->arrival = fr->last_read;
+    }
+    return found;
+}
+
+static int hex_value(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Checks for "$...*hh\r\n" sentence at p. Returns its length including
+ * line end, 0 if more bytes are needed or -1 if this is not a sentence. */
+static int nmea_sentence(const uint8_t *p, size_t avail)
+{
+    size_t i, j;
+    uint8_t sum = 0;
+    int hi, lo;
+    for (i = 1; i < avail && i < NMEA_MAX_SENTENCE; i++) {
+        if (p[i] == '\r')
+            break;
+        if (p[i] < 0x20 || p[i] > 0x7e)
+            return -1;
+    }
+    if (i >= NMEA_MAX_SENTENCE)
+        return -1;
+    if (i + 1 >= avail)
+        return 0;
+    if (p[i + 1] != '\n' || i < 4 || p[i - 3] != '*')
+        return -1;
+    hi = hex_value(p[i - 2]);
+    lo = hex_value(p[i - 1]);
+    if (hi < 0 || lo < 0)
+        return -1;
+    for (j = 1; j < i - 3; j++)
+        sum ^= p[j];
+    if (sum != ((hi << 4) | lo))
+        return -1;
+    return i + 2;
+}
+
+/* Pass sentence at head to its callback. Returns false if more bytes are
+ * needed to tell what is at head. */
+static bool take_nmea(osp_framer_t *fr)
+{
+    int len = nmea_sentence(&fr->rx[fr->head], fr->tail - fr->head);
+    if (len < 0) {
+        fr->head++;
+        count(fr->stats.skipped, 1);
+    } else if (len > 0) {
+        fr->protocol = OSP_PROTO_NMEA;
+        count(fr->stats.nmea, 1);
+        if (fr->nmea)
+            fr->nmea(fr->nmea_arg, (const char*)&fr->rx[fr->head], len - 2);
+        fr->head += len;
+    }
+    return len != 0;
+}
+
+/* Header at head turned out to be false. Step over its two bytes only, so
+ * real frame hidden in what was taken for payload is found by next scan. */
+static void resync(osp_framer_t *fr)
+{
+    fr->head += sizeof(HEADER);
+    count(fr->stats.skipped, sizeof(HEADER));
+    count(fr->stats.resyncs, 1);
+}
+
+/* Put interval since previous frame into histogram */
+static void account_arrival(osp_framer_t *fr)
+{
+    const struct timespec *now = &fr->arrival.mono;
+    int64_t ms;
+    int bucket = 0;
+    if (fr->previous.tv_sec || fr->previous.tv_nsec) {
+        ms = ((now->tv_sec - fr->previous.tv_sec) * 1000000000ll
+           + (now->tv_nsec - fr->previous.tv_nsec)) / 1000000;
+        while (ms > 0 && bucket < OSP_HISTOGRAM_BUCKETS - 1) {
+            ms >>= 1;
+            bucket++;
+        }
+        count(fr->stats.interval[bucket], 1);
+    }
+    fr->previous = *now;
+}
+
+osp_framer_t* osp_framer_alloc(void)
+{
+    osp_framer_t *fr = malloc(sizeof(osp_framer_t));
+    if (!fr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    fr->previous.tv_sec = fr->previous.tv_nsec = 0;
+    fr->nmea = NULL;
+    fr->nmea_arg = NULL;
+    memset(&fr->stats, 0, sizeof(fr->stats));
+    osp_framer_reset(fr);
+    return fr;
+}
+
+void osp_framer_free(osp_framer_t *framer)
+{
+    free(framer);
+}
+
+void osp_framer_reset(osp_framer_t *framer)
+{
+    framer->head = framer->tail = 0;
+    framer->stamped = NOT_STAMPED;
+    framer->length = 0;
+    framer->protocol = OSP_PROTO_UNKNOWN;
+}
+
+uint8_t* osp_framer_space(osp_framer_t *fr, size_t *room)
+{
+    if (fr->head == fr->tail) {
+        fr->head = fr->tail = 0;
+        fr->stamped = NOT_STAMPED;
+    } else if (fr->tail == sizeof(fr->rx)) {
+        memmove(fr->rx, &fr->rx[fr->head], fr->tail - fr->head);
+        if (fr->stamped != NOT_STAMPED)
+            fr->stamped -= fr->head;
+        fr->tail -= fr->head;
+        fr->head = 0;
+    }
+    *room = sizeof(fr->rx) - fr->tail;
+    return &fr->rx[fr->tail];
+}
+
+void osp_framer_commit(osp_framer_t *fr, size_t length, const osp_stamp_t *stamp)
+{
+    fr->last_read = *stamp;
+    fr->tail += length;
+    count(fr->stats.bytes_in, length);
+}
+
+int osp_framer_next(osp_framer_t *fr, size_t room, size_t *length)
+{
+    uint8_t *frame;
+    uint16_t len, tail;
+
+    for (;;) {
+        int found = scan(fr);
+        if (found == FOUND_NMEA && take_nmea(fr))
+            continue;
+        if (found != FOUND_OSP || fr->tail - fr->head < 4)
+            return OSP_FRAMER_MORE;
+        frame = &fr->rx[fr->head];
+        len = (frame[2] << 8) | frame[3];
+        /* do not wait for payload which can not be valid */
+        if (len == 0 || len > OSP_MAX_PAYLOAD || len > room) {
+            if (len)
+                count(fr->stats.oversize, 1);
+            resync(fr);
+            continue;
+        }
+        if (fr->tail - fr->head < len + OSP_FRAME_OVERHEAD)
+            return OSP_FRAMER_MORE;
+        break;
+    }
+
+    tail = (frame[6 + len] << 8) | frame[7 + len];
+    if (tail != 0xb0b3) {
+        count(fr->stats.bad_tail, 1);
+        resync(fr);
+        return OSP_FRAMER_BAD;
+    }
+    fr->length = len;
+    *length = len;
+    return OSP_FRAMER_FRAME;
+}
+
+int osp_framer_take(osp_framer_t *fr, uint8_t *dst)
+{
+    uint8_t *frame = &fr->rx[fr->head];
+    size_t len = fr->length;
+    uint16_t ck = (frame[4 + len] << 8) | frame[5 + len];
+
+    if (ck != osp_checksum_copy(dst, &frame[4], len)) {
+        count(fr->stats.bad_checksum, 1);
+        resync(fr);
+        return -1;
+    }
+    fr->head += len + OSP_FRAME_OVERHEAD;
+    fr->protocol = OSP_PROTO_OSP;
+    count(fr->stats.frames[dst[0]], 1);
+    account_arrival(fr);
+    return len;
+}
+
+void osp_framer_skip(osp_framer_t *fr)
+{
+    fr->head += fr->length + OSP_FRAME_OVERHEAD;
+}
+
+const osp_stamp_t* osp_framer_arrival(osp_framer_t *fr)
+{
+    return &fr->arrival;
+}
+
+void osp_framer_feed(osp_framer_t *fr, const void *bytes, size_t length,
+        size_t room, const osp_stamp_t *stamp, osp_framer_f cb, void *arg)
+{
+    const uint8_t *p = bytes;
+    uint8_t payload[OSP_MAX_PAYLOAD];
+    size_t avail, n, len;
+    uint8_t *space;
+    int rv;
+
+    if (room > sizeof(payload))
+        room = sizeof(payload);
+    do {
+        space = osp_framer_space(fr, &avail);
+        n = length < avail ? length : avail;
+        memcpy(space, p, n);
+        osp_framer_commit(fr, n, stamp);
+        p += n;
+        length -= n;
+
+        while ((rv = osp_framer_next(fr, room, &len)) != OSP_FRAMER_MORE) {
+            if (rv == OSP_FRAMER_FRAME && osp_framer_take(fr, payload) > 0)
+                cb(arg, payload, len, &fr->arrival);
+        }
+    } while (length);
+}
+
+void osp_framer_nmea(osp_framer_t *fr, osp_nmea_f cb, void *arg)
+{
+    fr->nmea = cb;
+    fr->nmea_arg = arg;
+}
+
+int osp_framer_protocol(osp_framer_t *fr)
+{
+    return fr->protocol;
+}
+
+void osp_framer_stats(osp_framer_t *fr, osp_transport_stats_t *stats)
+{
+    const uint64_t *src = (const uint64_t*)&fr->stats;
+    uint64_t *dst = (uint64_t*)stats;
+    size_t i;
+    /* structure is made of counters only */
+    for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+size_t osp_frame_encode(uint8_t *wire, const void *payload, size_t length)
+{
+    uint16_t ck;
+    if (length > OSP_MAX_PAYLOAD)
+        return 0;
+    memcpy(wire, HEADER, sizeof(HEADER));
+    wire[2] = length >> 8;
+    wire[3] = length & 0xFF;
+    ck = osp_checksum_copy(&wire[4], payload, length);
+    wire[4 + length] = ck >> 8;
+    wire[5 + length] = ck & 0xFF;
+    memcpy(&wire[6 + length], TAIL, sizeof(TAIL));
+    return length + OSP_FRAME_OVERHEAD;
+}
+
+/* vim: set ts=4 sw=4 et: */
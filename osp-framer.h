@@ -0,0 +1,105 @@
+#ifndef _OSP_FRAMER_H
+#define _OSP_FRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Framer finds OSP frames and NMEA sentences in bytes pushed to it. It does
+ * no I/O, starts no threads and never blocks, so it runs equally under a
+ * transport reading a tty, in an event loop or over a fuzzer's input. */
+
+/* Largest payload allowed by 11-bit length field */
+#define OSP_MAX_PAYLOAD 0x7FF
+
+/* header + length + payload + checksum + tail */
+#define OSP_FRAME_OVERHEAD 8
+
+/* Frame inter-arrival histogram. Bucket 0 counts intervals below 1 ms,
+ * bucket n those in [2^(n-1), 2^n) ms, the last one all longer. */
+#define OSP_HISTOGRAM_BUCKETS 16
+
+/* Link statistics. Counters only grow; any thread may take a snapshot. */
+typedef struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames[256];   /* valid frames per MID */
+    uint64_t bad_checksum;
+    uint64_t bad_tail;
+    uint64_t oversize;  /* headers announcing too long payload */
+    uint64_t skipped;   /* bytes dropped while looking for a frame */
+    uint64_t resyncs;   /* false headers stepped over */
+    uint64_t dropped;   /* frames lost for lack of free view buffer */
+    uint64_t nmea;      /* NMEA sentences received */
+    uint64_t interval[OSP_HISTOGRAM_BUCKETS];
+} osp_transport_stats_t;
+
+/* Protocol of the last valid message received */
+enum {
+    OSP_PROTO_UNKNOWN,
+    OSP_PROTO_OSP,
+    OSP_PROTO_NMEA,
+};
+
+/* Sentence without CR LF, checksum is already verified */
+typedef void (*osp_nmea_f)(void *arg, const char *sentence, size_t length);
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ll
+#endif
+
+/* Time of read which delivered first byte of frame header */
+typedef struct {
+    struct timespec mono;       /* CLOCK_MONOTONIC */
+    struct timespec real;       /* CLOCK_REALTIME */
+} osp_stamp_t;
+
+/* Valid frame, payload starting with MID is valid during the call only */
+typedef void (*osp_framer_f)(void *arg, const uint8_t *payload, size_t length,
+        const osp_stamp_t *arrival);
+
+typedef struct osp_framer osp_framer_t;
+
+enum {
+    OSP_FRAMER_MORE,            /* more bytes are needed */
+    OSP_FRAMER_FRAME,           /* frame is ready to be taken */
+    OSP_FRAMER_BAD,             /* broken frame was stepped over */
+};
+
+osp_framer_t* osp_framer_alloc(void);
+void osp_framer_free(osp_framer_t *framer);
+/* Forget buffered bytes, as after reopening link */
+void osp_framer_reset(osp_framer_t *framer);
+
+/* Push bytes received at stamp, cb gets every valid frame with payload up
+ * to room bytes they complete */
+void osp_framer_feed(osp_framer_t *framer, const void *bytes, size_t length,
+        size_t room, const osp_stamp_t *stamp, osp_framer_f cb, void *arg);
+
+/* Pull interface, for readers filling the buffer themselves. Read into
+ * space, commit what was read, then call next until it asks for more. */
+uint8_t* osp_framer_space(osp_framer_t *framer, size_t *room);
+void osp_framer_commit(osp_framer_t *framer, size_t length,
+        const osp_stamp_t *stamp);
+/* Find next frame with payload up to room bytes, sets its length */
+int osp_framer_next(osp_framer_t *framer, size_t room, size_t *length);
+/* Copy payload of frame found into dst. Returns its length, or -1 if
+ * checksum is bad. */
+int osp_framer_take(osp_framer_t *framer, uint8_t *dst);
+/* Step over frame found without taking it */
+void osp_framer_skip(osp_framer_t *framer);
+/* Arrival of frame found */
+const osp_stamp_t* osp_framer_arrival(osp_framer_t *framer);
+
+void osp_framer_nmea(osp_framer_t *framer, osp_nmea_f cb, void *arg);
+int osp_framer_protocol(osp_framer_t *framer);
+/* Receive side counters, bytes_out and dropped are left to caller */
+void osp_framer_stats(osp_framer_t *framer, osp_transport_stats_t *stats);
+
+/* Put payload into frame at wire, which has room for payload and
+ * OSP_FRAME_OVERHEAD. Returns length of frame, 0 if payload is too long. */
+size_t osp_frame_encode(uint8_t *wire, const void *payload, size_t length);
+
+#endif /* _OSP_FRAMER_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "osp-manager.h"
+
+#define MAX_EVENTS 32
+#define RX_CHUNK 4096
+
+/* Commands sent from other threads get their deadlines while reactor
+ * already sleeps, so it never sleeps longer than this, ms */
+#define IDLE_WAKEUP 250
+
+/* Receiver whose tty takes no output for this long fails the command, so
+ * it does not hold reactor and other receivers, ms */
+#define WRITE_TIMEOUT 500
+
+struct receiver {
+    osp_manager_t *mgr;
+    osp_t *osp;
+    int fd;
+    int completion_fd;
+    bool down;
+    struct receiver *next;
+};
+
+struct osp_manager {
+    int epfd;
+    int wakeup;                 /* eventfd */
+
+    /* guards receivers and is held by reactor while it serves them */
+    pthread_mutex_t lock;
+    struct receiver *receivers;
+    unsigned count;
+    unsigned down;
+
+    /* reactor */
+    pthread_t reactor;
+    bool running;
+    bool stop;
+    uint64_t cycle;             /* wakeups served */
+    pthread_cond_t served;
+
+    uint8_t rx[RX_CHUNK];
+};
+
+static long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Frames of commands, from reactor or threads issuing synchronous ones */
+static int sink(void *arg, const void *bytes, size_t length)
+{
+    struct receiver *r = arg;
+    const uint8_t *p = bytes;
+    struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+    long until = now_ms() + WRITE_TIMEOUT, left;
+    ssize_t rv;
+
+    while (length) {
+        rv = write(r->fd, p, length);
+        if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+            /* descriptor may be non-blocking */
+            if ((left = until - now_ms()) <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        if (rv <= 0)
+            return -1;
+        p += rv;
+        length -= rv;
+    }
+    return 0;
+}
+
+/* Called with lock held. Stops watching receiver which hung up. */
+static void receive(osp_manager_t *mgr, struct receiver *r)
+{
+    ssize_t rv = read(r->fd, mgr->rx, sizeof(mgr->rx));
+
+    if (rv > 0) {
+        osp_feed(r->osp, mgr->rx, rv);
+    } else if (rv == 0 || (errno != EAGAIN && errno != EINTR)) {
+        epoll_ctl(mgr->epfd, EPOLL_CTL_DEL, r->fd, NULL);
+        r->down = true;
+        mgr->down++;
+    }
+}
+
+static void* reactor(void *arg)
+{
+    osp_manager_t *mgr = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct receiver *r;
+    eventfd_t count;
+    int timeout, t, n, i;
+
+    pthread_mutex_lock(&mgr->lock);
+    for (;;) {
+        /* until first command of any receiver times out */
+        timeout = IDLE_WAKEUP;
+        for (r = mgr->receivers; r; r = r->next) {
+            t = osp_completion_timeout(r->osp);
+            if (t >= 0 && t < timeout)
+                timeout = t;
+        }
+        pthread_mutex_unlock(&mgr->lock);
+
+        n = epoll_wait(mgr->epfd, events, MAX_EVENTS, timeout);
+
+        pthread_mutex_lock(&mgr->lock);
+        if (mgr->stop)
+            break;
+        for (i = 0; i < n; i++) {
+            /* completion descriptors only wake reactor up, like wakeup */
+            if ((r = events[i].data.ptr))
+                receive(mgr, r);
+            else
+                eventfd_read(mgr->wakeup, &count);
+        }
+        for (r = mgr->receivers; r; r = r->next)
+            osp_process_completions(r->osp);
+        mgr->cycle++;
+        pthread_cond_broadcast(&mgr->served);
+    }
+    mgr->running = false;
+    pthread_cond_broadcast(&mgr->served);
+    pthread_mutex_unlock(&mgr->lock);
+    return NULL;
+}
+
+static void wake(osp_manager_t *mgr)
+{
+    eventfd_write(mgr->wakeup, 1);
+}
+
+osp_manager_t* osp_manager_alloc(void)
+{
+    osp_manager_t *mgr;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if (!(mgr = calloc(1, sizeof(osp_manager_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mgr->wakeup = -1;
+    if ((mgr->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        goto manager_error;
+    if ((mgr->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto manager_error;
+    if (epoll_ctl(mgr->epfd, EPOLL_CTL_ADD, mgr->wakeup, &ev) < 0)
+        goto manager_error;
+    pthread_mutex_init(&mgr->lock, NULL);
+    pthread_cond_init(&mgr->served, NULL);
+    return mgr;
+
+manager_error:
+    if (mgr->wakeup >= 0)
+        close(mgr->wakeup);
+    if (mgr->epfd >= 0)
+        close(mgr->epfd);
+    free(mgr);
+    return NULL;
+}
+
+void osp_manager_free(osp_manager_t *mgr)
+{
+    osp_manager_stop(mgr);
+    while (mgr->receivers)
+        osp_manager_remove(mgr, mgr->receivers->osp);
+    close(mgr->wakeup);
+    close(mgr->epfd);
+    pthread_cond_destroy(&mgr->served);
+    pthread_mutex_destroy(&mgr->lock);
+    free(mgr);
+}
+
+int osp_manager_start(osp_manager_t *mgr)
+{
+    if (mgr->running) {
+        errno = EBUSY;
+        return -1;
+    }
+    mgr->stop = false;
+    mgr->running = true;
+    if ((errno = pthread_create(&mgr->reactor, NULL, reactor, mgr))) {
+        mgr->running = false;
+        return -1;
+    }
+    return 0;
+}
+
+void osp_manager_stop(osp_manager_t *mgr)
+{
+    pthread_mutex_lock(&mgr->lock);
+    if (!mgr->running) {
+        pthread_mutex_unlock(&mgr->lock);
+        return;
+    }
+    mgr->stop = true;
+    wake(mgr);
+    pthread_mutex_unlock(&mgr->lock);
+    pthread_join(mgr->reactor, NULL);
+}
+
+osp_t* osp_manager_add(osp_manager_t *mgr, int fd,
+        const osp_callbacks_t *cb, void *cb_arg)
+{
+    struct receiver *r;
+    struct epoll_event ev = { .events = EPOLLIN };
+    int err;
+
+    if (!(r = calloc(1, sizeof(*r)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    r->mgr = mgr;
+    r->fd = fd;
+    if (!(r->osp = osp_alloc_sink(sink, r, cb, cb_arg)))
+        goto add_error;
+    /* done callbacks of asynchronous commands then run on reactor */
+    if ((r->completion_fd = osp_completion_fd(r->osp)) < 0)
+        goto add_error;
+    if (osp_start(r->osp))
+        goto add_error;
+
+    pthread_mutex_lock(&mgr->lock);
+    ev.data.ptr = r;
+    if (epoll_ctl(mgr->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_unlock(&mgr->lock);
+        goto started_error;
+    }
+    ev.data.ptr = NULL;
+    if (epoll_ctl(mgr->epfd, EPOLL_CTL_ADD, r->completion_fd, &ev) < 0) {
+        epoll_ctl(mgr->epfd, EPOLL_CTL_DEL, fd, NULL);
+        pthread_mutex_unlock(&mgr->lock);
+        goto started_error;
+    }
+    r->next = mgr->receivers;
+    mgr->receivers = r;
+    mgr->count++;
+    pthread_mutex_unlock(&mgr->lock);
+    return r->osp;
+
+started_error:
+    err = errno;
+    osp_stop(r->osp);
+    errno = err;
+add_error:
+    err = errno;
+    if (r->osp)
+        osp_free(r->osp);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+int osp_manager_remove(osp_manager_t *mgr, osp_t *osp)
+{
+    struct receiver *r = NULL, **link;
+    uint64_t cycle;
+
+    pthread_mutex_lock(&mgr->lock);
+    for (link = &mgr->receivers; *link; link = &(*link)->next) {
+        if ((*link)->osp == osp) {
+            r = *link;
+            *link = r->next;
+            break;
+        }
+    }
+    if (!r) {
+        pthread_mutex_unlock(&mgr->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    if (!r->down)
+        epoll_ctl(mgr->epfd, EPOLL_CTL_DEL, r->fd, NULL);
+    else
+        mgr->down--;
+    epoll_ctl(mgr->epfd, EPOLL_CTL_DEL, r->completion_fd, NULL);
+    mgr->count--;
+    /* Events reactor already took may still point to receiver, they are
+     * gone once it served them */
+    if (mgr->running) {
+        cycle = mgr->cycle;
+        wake(mgr);
+        while (mgr->running && mgr->cycle == cycle)
+            pthread_cond_wait(&mgr->served, &mgr->lock);
+    }
+    pthread_mutex_unlock(&mgr->lock);
+
+    osp_stop(r->osp);
+    osp_free(r->osp);
+    free(r);
+    return 0;
+}
+
+void osp_manager_stats(osp_manager_t *mgr, osp_manager_stats_t *stats)
+{
+    osp_transport_stats_t link;
+    osp_fix_t fix;
+    struct receiver *r;
+    const uint64_t *src = (const uint64_t*)&link;
+    uint64_t *dst = (uint64_t*)&stats->link;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&mgr->lock);
+    stats->receivers = mgr->count;
+    stats->down = mgr->down;
+    stats->wakeups = mgr->cycle;
+    for (r = mgr->receivers; r; r = r->next) {
+        osp_feed_stats(r->osp, &link);
+        /* structure is made of counters only */
+        for (i = 0; i < sizeof(link) / sizeof(uint64_t); i++)
+            dst[i] += src[i];
+        if (!osp_latest_fix(r->osp, &fix))
+            stats->fixes += fix.number;
+    }
+    pthread_mutex_unlock(&mgr->lock);
+}
+
+/* vim: set ts=4 sw=4 et: */
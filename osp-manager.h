@@ -0,0 +1,41 @@
+#ifndef _OSP_MANAGER_H
+#define _OSP_MANAGER_H
+
+#include "osp.h"
+
+/* Manager drives many receivers in push mode from one reactor thread
+ * waiting in epoll on their descriptors: it reads and feeds received
+ * bytes, writes commands, runs done callbacks of asynchronous commands
+ * and times them out. Handlers, callbacks and subscribers of all
+ * receivers run on the reactor thread. Larger gateways split receivers
+ * among few managers. */
+typedef struct osp_manager osp_manager_t;
+
+typedef struct {
+    unsigned receivers;
+    unsigned down;              /* receivers whose descriptor hung up */
+    uint64_t wakeups;           /* epoll waits returned */
+    uint64_t fixes;             /* MID41 received by all */
+    osp_transport_stats_t link; /* sum of all receivers */
+} osp_manager_stats_t;
+
+osp_manager_t* osp_manager_alloc(void);
+/* Receivers still added are removed */
+void osp_manager_free(osp_manager_t *mgr);
+int osp_manager_start(osp_manager_t *mgr);
+void osp_manager_stop(osp_manager_t *mgr);
+
+/* Add receiver on open descriptor of its tty, which stays the caller's.
+ * Returns osp it is driven through, started, or NULL with errno set. Use
+ * asynchronous commands, or synchronous ones from threads other than the
+ * reactor. Callbacks run with manager locked and must not call it. */
+osp_t* osp_manager_add(osp_manager_t *mgr, int fd,
+        const osp_callbacks_t *cb, void *cb_arg);
+/* Stop and free osp of receiver. Fails with ENOENT if it was not added. */
+int osp_manager_remove(osp_manager_t *mgr, osp_t *osp);
+
+void osp_manager_stats(osp_manager_t *mgr, osp_manager_stats_t *stats);
+
+#endif /* _OSP_MANAGER_H */
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "osp-replay.h"
+#include "osp-capture.h"
+#include "osp-transport.h"
+
+typedef struct {
+    io_t pub;
+    bool paced;
+
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    struct timespec start;
+
+    /* capture being replayed, incoming records are framed again */
+    osp_capture_reader_t *capture;
+    uint64_t first;
+    uint8_t frame[OSP_MAX_PAYLOAD + OSP_FRAME_OVERHEAD];
+    size_t frame_len;
+    size_t frame_pos;
+
+    char path[];
+} replay_t;
+
+static int64_t elapsed_ns(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * NSEC_PER_SEC
+         + (now.tv_nsec - since->tv_nsec);
+}
+
+/* Sleep until given time since open */
+static void pace(replay_t *r, int64_t at)
+{
+    int64_t wait = at - elapsed_ns(&r->start);
+    struct timespec ts = { wait / NSEC_PER_SEC, wait % NSEC_PER_SEC };
+    if (wait > 0)
+        nanosleep(&ts, NULL);
+}
+
+static int m_open(io_t *io)
+{
+    replay_t *r = (replay_t*)io;
+    struct stat st;
+
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    if ((r->capture = osp_capture_reader_open(r->path)) != NULL) {
+        r->first = 0;
+        r->frame_len = r->frame_pos = 0;
+        return 0;
+    }
+    if ((r->fd = open(r->path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(r->fd, &st) < 0)
+        goto replay_open_error;
+    r->size = st.st_size;
+    r->pos = 0;
+    r->data = NULL;
+    if (r->size) {
+        r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if (r->data == MAP_FAILED)
+            goto replay_open_error;
+        madvise((void*)r->data, r->size, MADV_SEQUENTIAL);
+    }
+    return 0;
+replay_open_error:
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+static int m_write(io_t *io, void *buffer, size_t size)
+{
+    return size;
+}
+
+/* Unpaced, frames are packed into buffer until it is full. Paced, each read
+ * returns one frame when its recorded time comes. */
+static int read_capture(replay_t *r, uint8_t *buffer, size_t size)
+{
+    osp_capture_record_t rec;
+    size_t done = 0, n;
+
+    while (done < size) {
+        if (r->frame_pos == r->frame_len) {
+            if (done && r->paced)
+                break;
+            if (!osp_capture_next(r->capture, &rec))
+                break;
+            /* sessions have timelines of their own, the gap between them
+             * is not waited out */
+            if (rec.dir == OSP_SESSION)
+                r->first = 0;
+            if (rec.dir != OSP_INCOMING || rec.length > OSP_MAX_PAYLOAD)
+                continue;
+            if (!r->first || rec.stamp < r->first) {
+                r->first = rec.stamp;
+                clock_gettime(CLOCK_MONOTONIC, &r->start);
+            }
+            if (r->paced)
+                pace(r, rec.stamp - r->first);
+            r->frame_len = osp_frame_encode(r->frame, rec.data, rec.length);
+            r->frame_pos = 0;
+        }
+        n = r->frame_len - r->frame_pos;
+        if (n > size - done)
+            n = size - done;
+        memcpy(&buffer[done], &r->frame[r->frame_pos], n);
+        r->frame_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static int m_read(io_t *io, void *buffer, size_t size)
+{
+    replay_t *r = (replay_t*)io;
+    size_t left = r->size - r->pos;
+    size_t n;
+
+    if (r->capture)
+        return read_capture(r, buffer, size);
+    if (r->fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!left)
+        return 0;
+    n = size < left ? size : left;
+    if (r->paced) {
+        size_t due = elapsed_ns(&r->start) * OSP_REPLAY_RAW_RATE / NSEC_PER_SEC;
+        if (due <= r->pos) {
+            /* sleep until next byte is due on the line */
+            pace(r, (r->pos + 1) * NSEC_PER_SEC / OSP_REPLAY_RAW_RATE);
+            due = r->pos + 1;
+        }
+        if (n > due - r->pos)
+            n = due - r->pos;
+    }
+    memcpy(buffer, &r->data[r->pos], n);
+    r->pos += n;
+    return n;
+}
+
+static int m_close(io_t *io)
+{
+    replay_t *r = (replay_t*)io;
+    if (r->capture)
+        osp_capture_reader_close(r->capture);
+    r->capture = NULL;
+    if (r->data)
+        munmap((void*)r->data, r->size);
+    r->data = NULL;
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    return 0;
+}
+
+io_t* osp_replay_alloc(const char *path, bool paced)
+{
+    replay_t *r = malloc(sizeof(replay_t) + strlen(path) + 1);
+    if (!r) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(r, 0, sizeof(replay_t));
+    strcpy(r->path, path);
+    r->pub.open = m_open;
+    r->pub.write = m_write;
+    r->pub.read = m_read;
+    r->pub.close = m_close;
+    r->paced = paced;
+    r->fd = -1;
+    return (io_t*)r;
+}
+
+/* vim: set ts=4 sw=4 et: */
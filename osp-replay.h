@@ -0,0 +1,21 @@
+#ifndef _OSP_REPLAY_H
+#define _OSP_REPLAY_H
+
+#include <stdbool.h>
+#include <driver/io.h>
+
+/* Serial line speed assumed when pacing raw captures (115200 8N1) */
+#define OSP_REPLAY_RAW_RATE (115200 / 10)
+
+/* io_t feeding bytes of recording, to be wrapped with osp_transport_alloc()
+ * in place of serial. File is memory mapped and may be either raw byte dump
+ * or capture written by osp_capture_open(), whose incoming frames are
+ * replayed. Without pacing bytes are delivered as fast as they are read;
+ * with pacing raw dump goes at OSP_REPLAY_RAW_RATE and capture at recorded
+ * times, sessions following each other without the gap between them.
+ * Writes are discarded. Read returns 0 at the end. */
+io_t* osp_replay_alloc(const char *path, bool paced);
+
+#endif /* _OSP_REPLAY_H */
+
+/* vim: set ts=4 sw=4 et: */
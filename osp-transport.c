@@ -1,111 +1,153 @@
 #include <stdlib.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include "osp-transport.h"
-#include "endian.h"
 
-const uint8_t HEADER[] = {0xa0, 0xa2};
-const uint8_t TAIL[] = {0xb0, 0xb3};
+/* Statistics are written by reading thread only, so a relaxed store is
+ * enough to keep them untorn for other threads, without locked add. */
+#define count(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
 
+typedef struct {
+    int refs;
+    uint8_t data[OSP_MAX_PAYLOAD];
+} rx_slot_t;
+
+/* Transport is the blocking adapter of framer to io_t: it reads lower io
+ * into framer until a frame is found and writes frames it encodes. */
 typedef struct {
     io_t pub;
     io_t *io;
+    osp_framer_t *framer;
+
+    /* view mode buffers */
+    rx_slot_t *pool;
+    unsigned pool_size;
+    unsigned pool_next;
+
+    /* only counters framer does not keep */
+    uint64_t bytes_out;
+    uint64_t dropped;
 } osp_transport_t;
 
-static uint16_t osp_checksum(uint8_t *payload, uint16_t plen) {
-    uint16_t cksum = 0;
-    int i;
-    for(i = 0; i < plen; i++) {
-        cksum += (uint16_t)payload[i];
-        cksum &= 0x7FFF;
-    }
-    return cksum;
+/* Pull as many bytes as lower io has ready into framer. */
+static int fill(osp_transport_t *ot)
+{
+    osp_stamp_t stamp;
+    size_t room;
+    uint8_t *space = osp_framer_space(ot->framer, &room);
+    int rv = ot->io->read(ot->io, space, room);
+    if (rv <= 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &stamp.mono);
+    clock_gettime(CLOCK_REALTIME, &stamp.real);
+    osp_framer_commit(ot->framer, rv, &stamp);
+    return rv;
+}
+
+static int m_open(io_t *io)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    osp_framer_reset(ot->framer);
+    return ot->io->open(ot->io);
 }
 
-static int read_exactly(io_t *io, uint8_t *buffer, uint16_t len) {
-    int already = 0;
+static int write_exactly(io_t *io, uint8_t *buffer, size_t len) {
+    size_t already = 0;
     int rv;
     do {
-        if ((rv = io->read(io, &buffer[already], len - already)) <= 0)
-            return rv;
+        if ((rv = io->write(io, &buffer[already], len - already)) <= 0)
+            return -1;
         already += rv;
-    } while (already != len);
+    } while (already < len);
     return already;
 }
 
-static int scan_for_header(io_t* io) {
-    uint8_t b;
-    bool nibble = false;
-    do {
-        if (io->read(io, &b, 1) != 1)
-            return -1;
-        if (!nibble && b == 0xa0)
-            nibble = true;
-        else if (nibble && b == 0xa2)
-            break;
-        else
-            nibble = false;
-    } while(1);
+/* Whole frame is assembled on stack and passed to lower io at once, so it
+ * leaves as one syscall instead of five. */
+static int m_write(io_t *io, void *buffer, size_t size)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    uint8_t frame[OSP_MAX_PAYLOAD + OSP_FRAME_OVERHEAD];
+    size_t length = osp_frame_encode(frame, buffer, size);
+    if (!length)
+        return -1;
+    if (write_exactly(ot->io, frame, length) < 0)
+        return -1;
+    /* writers may be many, unlike reader */
+    __atomic_add_fetch(&ot->bytes_out, length, __ATOMIC_RELAXED);
     return 0;
 }
 
-static int m_open(io_t *io)
+static rx_slot_t* slot_get(osp_transport_t *ot)
 {
-    osp_transport_t *ot = (osp_transport_t*)io;
-    return ot->io->open(ot->io);
+    unsigned i;
+    for (i = 0; i < ot->pool_size; i++) {
+        rx_slot_t *slot = &ot->pool[(ot->pool_next + i) % ot->pool_size];
+        /* only reader takes free slots, so nobody races for it */
+        if (!__atomic_load_n(&slot->refs, __ATOMIC_ACQUIRE)) {
+            slot->refs = 1;
+            ot->pool_next = (ot->pool_next + i + 1) % ot->pool_size;
+            return slot;
+        }
+    }
+    return NULL;
 }
 
-static int m_write(io_t *io, void *buffer, size_t size)
+static void slot_put(rx_slot_t *slot)
 {
-    osp_transport_t *ot = (osp_transport_t*)io;
-    io_t *lio = ot->io;
-    uint16_t ck_be = htobe16(osp_checksum(buffer, size));
-    uint16_t size_be = htobe16((uint16_t)size);
-    if (size > 0xFFFF)
-        return -1;
-    if (lio->write(lio, (uint8_t*)&HEADER, sizeof(HEADER)) < 0) goto osp_send_error;
-    if (lio->write(lio, &size_be, 2) < 0) goto osp_send_error;
-    if (lio->write(lio, buffer, size) < 0) goto osp_send_error;
-    if (lio->write(lio, &ck_be, 2) < 0) goto osp_send_error;
-    if (lio->write(lio, (uint8_t*)&TAIL, sizeof(HEADER)) < 0) goto osp_send_error;
-    return 0;
-osp_send_error:
-    return -1;
+    __atomic_sub_fetch(&slot->refs, 1, __ATOMIC_RELEASE);
 }
 
+/* Returns one frame per call. Frames which arrived together with the current
+ * one stay buffered and are returned by following calls without touching
+ * lower io. Broken frame is reported with -1, but only its header is
+ * dropped; the rest of its bytes are scanned again.
+ * In view mode buffer receives osp_frame_view_t of pooled copy. */
 static int m_read(io_t *io, void *buffer, size_t size)
 {
-    uint16_t length;
-    uint16_t ck, ck_calc;
-    uint16_t tail;
     osp_transport_t *ot = (osp_transport_t*)io;
-    io_t *lio = ot->io;
+    uint8_t *payload = buffer;
+    size_t room = size;
+    size_t length;
+    rx_slot_t *slot = NULL;
+    int rv;
 
-    if (!scan_for_header(lio)) {
-        if (read_exactly(lio, (uint8_t*)&length, 2) < 0) goto osp_recv_error;
-        length = htobe16(length);
-        if (length > size) {
-            printf("osp_recv: recv buffer to small: %d < %d\n", size, length);
+    if (ot->pool) {
+        if (size < sizeof(osp_frame_view_t))
             return -1;
-        }
-        if (read_exactly(lio, buffer, length) < 0) goto osp_recv_error;
-        if (read_exactly(lio, (uint8_t*)&ck, 2) < 0) goto osp_recv_error;
-        if (read_exactly(lio, (uint8_t*)&tail, 2) < 0) goto osp_recv_error;
-        ck = htobe16(ck);
-        tail = htobe16(tail);
-        if (tail != 0xb0b3) {
-            printf("osp_recv: unexpected tail value: 0x%04x\n", tail);
+        room = OSP_MAX_PAYLOAD;
+    }
+
+    while ((rv = osp_framer_next(ot->framer, room, &length)) == OSP_FRAMER_MORE) {
+        if (fill(ot) < 0)
             return -1;
-        }
-        ck_calc = osp_checksum(buffer, length);
-        if(ck != ck_calc) {
-            printf("osp_recv: invalid checksum. recv=0x%04x != calc=0x%04x\n", ck, ck_calc);
+    }
+    if (rv == OSP_FRAMER_BAD)
+        return -1;
+    if (ot->pool) {
+        if (!(slot = slot_get(ot))) {
+            count(ot->dropped, 1);
+            osp_framer_skip(ot->framer);
             return -1;
         }
-        return length;
+        payload = slot->data;
+    }
+    if (osp_framer_take(ot->framer, payload) < 0) {
+        if (slot)
+            slot_put(slot);
+        return -1;
+    }
+    if (slot) {
+        osp_frame_view_t *view = buffer;
+        view->data = slot->data;
+        view->length = length;
+        view->arrival = *osp_framer_arrival(ot->framer);
+        view->slot = slot;
+        return sizeof(*view);
     }
-osp_recv_error:
-    return -1;
+    return length;
 }
 
 static int m_close(io_t *io)
@@ -114,13 +156,88 @@ static int m_close(io_t *io)
     return ot->io->close(ot->io);
 }
 
+void osp_transport_stats(io_t *io, osp_transport_stats_t *stats)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    osp_framer_stats(ot->framer, stats);
+    stats->bytes_out = __atomic_load_n(&ot->bytes_out, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&ot->dropped, __ATOMIC_RELAXED);
+}
+
+void osp_transport_nmea(io_t *io, osp_nmea_f cb, void *arg)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    osp_framer_nmea(ot->framer, cb, arg);
+}
+
+int osp_transport_protocol(io_t *io)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    return osp_framer_protocol(ot->framer);
+}
+
+void osp_transport_arrival(io_t *io, osp_stamp_t *stamp)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    *stamp = *osp_framer_arrival(ot->framer);
+}
+
+int osp_transport_views(io_t *io, unsigned buffers)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    if (ot->pool || !buffers) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(ot->pool = calloc(buffers, sizeof(rx_slot_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ot->pool_size = buffers;
+    return 0;
+}
+
+int osp_frame_hold(const osp_frame_view_t *view)
+{
+    if (!view->slot)
+        return -1;
+    __atomic_add_fetch(&((rx_slot_t*)view->slot)->refs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void osp_frame_release(const osp_frame_view_t *view)
+{
+    if (view->slot)
+        slot_put(view->slot);
+}
+
 io_t* osp_transport_alloc(io_t *io)
 {
     osp_transport_t *ot = malloc(sizeof(osp_transport_t));
+    if (!ot)
+        return NULL;
+    if (!(ot->framer = osp_framer_alloc())) {
+        free(ot);
+        return NULL;
+    }
     ot->pub.open = m_open;
     ot->pub.write = m_write;
     ot->pub.read = m_read;
     ot->pub.close = m_close;
     ot->io = io;
+    ot->pool = NULL;
+    ot->pool_size = ot->pool_next = 0;
+    ot->bytes_out = 0;
+    ot->dropped = 0;
     return (io_t*)ot;
 }
+
+void osp_transport_free(io_t *io)
+{
+    osp_transport_t *ot = (osp_transport_t*)io;
+    osp_framer_free(ot->framer);
+    free(ot->pool);
+    free(ot);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -1,11 +1,37 @@
 #ifndef _OSP_TRANSPORT_H
 #define _OSP_TRANSPORT_H
 
-#include <stddef.h>
-#include <stdint.h>
 #include <driver/io.h>
+#include "osp-framer.h"
+
+/* Read-only view of received frame */
+typedef struct {
+    const void *data;           /* payload, starting with MID */
+    size_t length;
+    osp_stamp_t arrival;
+    void *slot;                 /* buffer backing data, NULL if not pooled */
+} osp_frame_view_t;
 
 io_t* osp_transport_alloc(io_t *io);
+/* Lower io stays the caller's */
+void osp_transport_free(io_t *io);
+void osp_transport_stats(io_t *io, osp_transport_stats_t *stats);
+
+/* NMEA sentences found between frames are passed to cb, called from reading
+ * thread. Frames are still returned by read. */
+void osp_transport_nmea(io_t *io, osp_nmea_f cb, void *arg);
+int osp_transport_protocol(io_t *io);
+
+/* Arrival of frame returned by the last read */
+void osp_transport_arrival(io_t *io, osp_stamp_t *stamp);
+
+/* Make transport keep received frames in a pool of buffers. Each read then
+ * returns osp_frame_view_t instead of a copy of payload. Call before open. */
+int osp_transport_views(io_t *io, unsigned buffers);
+
+/* Keep pooled frame beyond dispatch. Fails with -1 if view is not pooled. */
+int osp_frame_hold(const osp_frame_view_t *view);
+void osp_frame_release(const osp_frame_view_t *view);
 
 #endif /* _OSP_TRANSPORT_H */
 
@@ -1,5 +1,5 @@
 #include "osp.h"
-#include "endian.h"
+#include "osp-builder.h"
 //#include "geodesy.h"
 
 #include <errno.h>
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <ctype.h>
 #include <time.h>
 #include <syslog.h>
@@ -35,46 +36,221 @@ enum {
     SCAN_CONSUMED,
     SCAN_FINISHED,
 };
-typedef int (*scanner_f)(osp_t *osp, void *arg, osp_frame_t *frame, size_t len);
+typedef int (*scanner_f)(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len);
+
+/* Most response MIDs a single exchange listens on */
+#define EXCHANGE_MIDS 2
+#define NO_MID (-1)
+/* Fixes worse than these, in m, are not cached for position aiding */
+#define CACHE_MAX_ERR_H 200
+#define CACHE_MAX_ERR_V 300
+/* Error assumed for seed not telling its own, m */
+#define SEED_ERR_H 120
+#define SEED_ERR_V 100
+/* MID2 gives TOW in 10 ms, MID41 in ms, so stamps of the same fix differ
+ * by up to this much, ms */
+#define HISTORY_MERGE 10
+/* Receiver time going back further is taken for restart, ms */
+#define HISTORY_RESTART 1000
+
+/* Milliseconds command waits for its response, unless set otherwise */
+#define EXCHANGE_TIMEOUT 8000
+#define READY_TIMEOUT 5000
+
+enum {
+    EX_QUEUED,      /* waiting for room in window */
+    EX_ARMED,       /* holds window slot */
+    EX_DONE,
+};
+
+struct exchange;
+struct exchange_link {
+    struct exchange_link *next;
+    struct exchange *ex;
+};
+
+/* Outstanding request/response, armed on every MID response may come in.
+ * Exchanges waiting on the same MID complete in order they were sent, as
+ * receiver answers commands in order. */
+struct ack {
+    uint8_t mid;    /* acknowledged */
+    int result;
+};
+
+struct poll_eph_result {
+    ephemeris_t *eph;
+    int count;
+};
+
+union exchange_data {
+    struct ack ack;
+    uint8_t response[2];
+    struct poll_eph_result eph;
+};
+
+struct exchange {
+    scanner_f scanner;
+    void *arg;
+    int nmids;
+    uint8_t mids[EXCHANGE_MIDS];
+    struct exchange_link link[EXCHANGE_MIDS];
+    int state;
+    int result;
+    int64_t deadline;           /* CLOCK_MONOTONIC, ns, once sent */
+    int attempts;               /* retries so far */
+    pthread_cond_t signal;      /* CLOCK_MONOTONIC */
+
+    /* command result from result of exchange */
+    int (*finish)(struct exchange *ex, int retval);
+
+    /* asynchronous, completed through callback instead of signal */
+    osp_done_f callback;
+    void *cb_arg;
+    int64_t not_before;         /* retry is not sent sooner, ns */
+    bool launched;
+    struct exchange *next;      /* pending or completed */
+    struct exchange *queued;    /* backlog */
+
+    /* response of commands not returning it to caller, and its state
+     * before first attempt to start retries from */
+    union exchange_data data;
+    union exchange_data initial;
+
+    size_t length;
+    uint8_t tx[OSP_MID130_LEN]; /* longest command */
+};
+
+struct subscription {
+    struct subscription *next;
+    int sid;
+    osp_msg_f cb;
+    void *arg;
+};
+
+struct queued_frame {
+    osp_frame_view_t view;      /* data points to frame, unless pooled */
+    osp_frame_t frame;
+};
+
+/* Frames from receiving thread to dispatch worker. Only receiving thread
+ * moves tail. Worker moves head once it copied frame out, and so does
+ * receiving thread dropping oldest frame; worker then finds head moved
+ * and discards its copy. Sides sleep only on empty or full queue. */
+struct dispatch_queue {
+    struct queued_frame *frames;
+    unsigned depth;
+    int policy;
+    uint64_t head;
+    uint64_t tail;
+    int worker_waits;
+    int reader_waits;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+    pthread_t worker;
+    osp_queue_stats_t stats;    /* written by receiving thread only */
+};
+
+/* Ring of fixes, ordered by GPS time. Only receiving thread adds. */
+struct history {
+    pthread_mutex_t lock;
+    osp_history_fix_t *fixes;
+    unsigned depth;
+    unsigned count;
+    unsigned next;              /* slot of next fix */
+};
 
 struct osp {
     driver_t *driver;
+    io_t *transport;
     osp_frame_t input;
-    osp_frame_t output;
 
-    bool busy;
-    pthread_mutex_t lock;
-    pthread_cond_t signal;
+    /* push mode, when there is no driver: bytes are fed to framer and
+     * frames sent go to sink */
+    osp_framer_t *framer;
+    osp_sink_f sink;
+    void *sink_arg;
+    uint64_t bytes_out;
+
+    /* zero-copy mode, driver delivers views instead of input */
+    bool views;
+    osp_frame_view_t view;
+
+    /* frames dispatched on worker thread, NULL if on receiving one */
+    struct dispatch_queue *queue;
+    bool started;               /* queue can not be added past start */
+
+    osp_capture_t *capture;
+
+    /* serializes frames of concurrent senders */
+    pthread_mutex_t send_lock;
 
     /* callback */
     void *arg;
     const osp_callbacks_t* callbacks;
 
-    /* scanner */
-    void *scan_arg;
-    scanner_f scanner;
+    /* subscribers, by MID */
+    pthread_rwlock_t subs_lock;
+    struct subscription *subs[256];
 
-    /* cache */
+    /* outstanding exchanges, by response MID, oldest first */
+    pthread_mutex_t lock;
+    struct exchange_link *scanners[256];
+    unsigned window;
+    unsigned inflight;
+    pthread_cond_t room;
+
+    /* by MID of request, ms */
+    unsigned timeouts[256];
+    osp_retry_t retry;
+
+    /* asynchronous exchanges, by deadline, waiting for room in window, and
+     * waiting for their callbacks to run */
+    struct exchange *pending;
+    struct exchange *backlog, **backlog_tail;
+    struct exchange *completed, **completed_tail;
+    int completion_fd;
+
+    /* start-up in progress, NULL otherwise */
+    osp_startup_report_t *startup;
+    int64_t startup_begin;      /* CLOCK_MONOTONIC, ns */
+
+    /* latest MID41, seqlock written by receiving thread only: seq is odd
+     * while fix is being written */
+    uint64_t fix_seq;
+    osp_fix_t fix;
+
+    /* fix history, NULL if not kept */
+    struct history *history;
+
+    /* cache, guarded by lock */
     struct {
         struct osp_position position;
+        int64_t stamp;          /* CLOCK_MONOTONIC, ns, of fix or seed */
         int32_t clock_drift;
         bool valid;
     } cache;
 };
 
-#if CONFIG_DUMP_PROTOCOL
-static void log_line(char dir, void *frame, size_t length) {
-    char message[256];
-    int l;
-    l = snprintf(message, sizeof(message), "%c (mid: %3d, length: %3d) ", dir, ((uint8_t*)frame)[0], length);
-    int i;
-    for(i = 0; i < length; i++)
-        l += snprintf(message + l, sizeof(message) - l, "%02x", ((uint8_t*)frame)[i]);
-    syslog(LOG_DEBUG | LOG_LOCAL0, message);
+static void capture(osp_t *osp, int dir, const struct timespec *stamp,
+        const void *frame, size_t length)
+{
+    osp_capture_t *cap = __atomic_load_n(&osp->capture, __ATOMIC_ACQUIRE);
+    struct timespec now;
+    if (!cap)
+        return;
+    if (!stamp) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stamp = &now;
+    }
+    osp_capture_record(cap, dir, stamp, frame, length);
+}
+
+static inline int64_t timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
 }
-#else
-#   define log_line(...)
-#endif
 
 static inline void utc_to_gps(uint16_t *wn, uint32_t *tow, time_t utc)
 {
@@ -83,138 +259,616 @@ static inline void utc_to_gps(uint16_t *wn, uint32_t *tow, time_t utc)
     *tow = gps % SECONDS_PER_WEEK;
 }
 
-static inline int osp_send(osp_t *osp, size_t length)
+/* Called with send_lock held */
+static int transmit(osp_t *osp, void *frame, size_t length)
+{
+    uint8_t wire[OSP_MAX_PAYLOAD + OSP_FRAME_OVERHEAD];
+    size_t size;
+
+    if (osp->driver)
+        return driver_send(osp->driver, frame, length);
+    if (!(size = osp_frame_encode(wire, frame, length)))
+        return -1;
+    if (osp->sink(osp->sink_arg, wire, size))
+        return -1;
+    __atomic_add_fetch(&osp->bytes_out, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline int osp_send(osp_t *osp, void *frame, size_t length)
+{
+    int retval;
+    pthread_mutex_lock(&osp->send_lock);
+    capture(osp, OSP_OUTGOING, NULL, frame, length);
+    retval = transmit(osp, frame, length);
+    pthread_mutex_unlock(&osp->send_lock);
+    return retval;
+}
+
+static void exchange_init(struct exchange *ex,
+        scanner_f scanner, void *arg, int mid, int mid2)
+{
+    pthread_condattr_t attr;
+
+    ex->scanner = scanner;
+    ex->arg = arg;
+    ex->nmids = 0;
+    if (mid != NO_MID)
+        ex->mids[ex->nmids++] = mid;
+    if (mid2 != NO_MID)
+        ex->mids[ex->nmids++] = mid2;
+    ex->state = EX_QUEUED;
+    ex->result = 0;
+    ex->deadline = INT64_MAX;
+    ex->attempts = 0;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ex->signal, &attr);
+    pthread_condattr_destroy(&attr);
+    ex->finish = NULL;
+    ex->callback = NULL;
+    ex->cb_arg = NULL;
+    ex->not_before = 0;
+    ex->launched = false;
+    ex->next = NULL;
+    ex->queued = NULL;
+    ex->length = 0;
+}
+
+/* With osp->lock held */
+static void arm(osp_t *osp, struct exchange *ex)
+{
+    struct exchange_link **tail;
+    int i;
+    for (i = 0; i < ex->nmids; i++) {
+        ex->link[i].next = NULL;
+        ex->link[i].ex = ex;
+        for (tail = &osp->scanners[ex->mids[i]]; *tail; tail = &(*tail)->next);
+        *tail = &ex->link[i];
+    }
+}
+
+/* With osp->lock held. Frees window slot of exchange, if it sent frame. */
+static void disarm(osp_t *osp, struct exchange *ex)
+{
+    struct exchange_link **link;
+    int i;
+    for (i = 0; i < ex->nmids; i++) {
+        for (link = &osp->scanners[ex->mids[i]]; *link; link = &(*link)->next) {
+            if (*link == &ex->link[i]) {
+                *link = ex->link[i].next;
+                break;
+            }
+        }
+    }
+    if (!ex->length)
+        return;
+    osp->inflight--;
+    pthread_cond_signal(&osp->room);
+}
+
+/* With osp->lock held. Synchronous exchange is signalled, asynchronous
+ * one moves to completed. */
+static void complete(osp_t *osp, struct exchange *ex, int result)
+{
+    struct exchange **link;
+
+    if (ex->state == EX_ARMED)
+        disarm(osp, ex);
+    ex->state = EX_DONE;
+    ex->result = result;
+    if (!ex->callback) {
+        pthread_cond_signal(&ex->signal);
+        return;
+    }
+    for (link = &osp->pending; *link; link = &(*link)->next) {
+        if (*link == ex) {
+            *link = ex->next;
+            break;
+        }
+    }
+    ex->next = NULL;
+    *osp->completed_tail = ex;
+    osp->completed_tail = &ex->next;
+}
+
+/* Offer frame to exchanges waiting for its MID, oldest first, until one
+ * takes it */
+static int scan(osp_t *osp, const osp_frame_t *frame, size_t length)
+{
+    struct exchange_link *link;
+    struct exchange *ex;
+    int retval = SCAN_SKIPPED;
+
+    pthread_mutex_lock(&osp->lock);
+    for (link = osp->scanners[frame->mid]; link; link = link->next) {
+        ex = link->ex;
+        retval = ex->scanner(osp, ex->arg, frame, length);
+        if (retval == SCAN_FINISHED)
+            complete(osp, ex, 0);
+        if (retval != SCAN_SKIPPED)
+            break;
+    }
+    pthread_mutex_unlock(&osp->lock);
+    return retval;
+}
+
+static inline int64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now);
+}
+
+/* Delay before retry, doubled with every attempt */
+static int64_t backoff(const osp_retry_t *retry, int attempt)
+{
+    uint64_t ms = retry->backoff_ms;
+    while (--attempt > 0 && ms < UINT32_MAX)
+        ms <<= 1;
+    if (retry->backoff_max_ms && ms > retry->backoff_max_ms)
+        ms = retry->backoff_max_ms;
+    return ms * 1000000ll;
+}
+
+/* With osp->lock held. Exchange starts over, from before first attempt. */
+static void rewind_exchange(struct exchange *ex)
+{
+    ex->state = EX_QUEUED;
+    ex->result = 0;
+    ex->deadline = INT64_MAX;
+    ex->data = ex->initial;
+}
+
+/* Time out asynchronous exchanges past their deadline or queue them again,
+ * as retry policy says. Returns count, including retries due to be sent. */
+static int expire(osp_t *osp)
+{
+    struct exchange *ex, *next;
+    int64_t now = 0;
+    int count = 0;
+
+    pthread_mutex_lock(&osp->lock);
+    if (osp->pending)
+        now = now_ns();
+    for (ex = osp->pending; ex; ex = next) {
+        next = ex->next;
+        if (ex->state == EX_QUEUED) {
+            if (ex->not_before && ex->not_before <= now)
+                count++;
+            continue;
+        }
+        if (ex->deadline > now)
+            continue;
+        count++;
+        if (ex->attempts >= osp->retry.retries) {
+            complete(osp, ex, ETIMEDOUT);
+            continue;
+        }
+        disarm(osp, ex);
+        rewind_exchange(ex);
+        ex->not_before = now + backoff(&osp->retry, ++ex->attempts);
+        ex->queued = NULL;
+        *osp->backlog_tail = ex;
+        osp->backlog_tail = &ex->queued;
+    }
+    pthread_mutex_unlock(&osp->lock);
+    return count;
+}
+
+/* With osp->lock held. Earliest deadline of asynchronous exchanges sent,
+ * which hold window slots until answered or timed out. */
+static int64_t armed_deadline(osp_t *osp)
+{
+    struct exchange *ex;
+    int64_t next = INT64_MAX;
+
+    for (ex = osp->pending; ex; ex = ex->next) {
+        if (ex->state == EX_ARMED && ex->deadline < next)
+            next = ex->deadline;
+    }
+    return next;
+}
+
+/* Time exchange has for response, ns. Request without frame waits for MID
+ * of its response. */
+static int64_t exchange_timeout(osp_t *osp, struct exchange *ex)
+{
+    return osp->timeouts[ex->length ? ex->tx[0] : ex->mids[0]] * 1000000ll;
+}
+
+/* Arm exchange holding window slot and send its frame */
+static void launch(osp_t *osp, struct exchange *ex)
+{
+    int retval = 0;
+
+    /* Armed in order of sending, so responses correlate, and before
+     * sending, as response may come before send returns */
+    pthread_mutex_lock(&osp->send_lock);
+    pthread_mutex_lock(&osp->lock);
+    if (ex->state == EX_DONE) {
+        /* expired while waiting for its turn */
+        ex->launched = true;
+        pthread_mutex_unlock(&osp->lock);
+        pthread_mutex_unlock(&osp->send_lock);
+        return;
+    }
+    if (!ex->attempts)
+        ex->initial = ex->data;
+    arm(osp, ex);
+    pthread_mutex_unlock(&osp->lock);
+    if (ex->length) {
+        capture(osp, OSP_OUTGOING, NULL, ex->tx, ex->length);
+        retval = transmit(osp, ex->tx, ex->length);
+    }
+    pthread_mutex_unlock(&osp->send_lock);
+
+    /* Until launched, completed exchange is not released. Time to answer
+     * counts from sending, so exchange can not expire and be queued again
+     * while send blocks. */
+    pthread_mutex_lock(&osp->lock);
+    ex->launched = true;
+    if (ex->state == EX_ARMED) {
+        if (retval || !ex->nmids)
+            complete(osp, ex, retval);
+        else
+            ex->deadline = now_ns() + exchange_timeout(osp, ex);
+    }
+    pthread_mutex_unlock(&osp->lock);
+}
+
+/* Launch queued asynchronous exchanges while window has room. Retry
+ * waiting out its backoff holds back these queued after it. */
+static void pump(osp_t *osp)
+{
+    struct exchange *ex;
+
+    for (;;) {
+        pthread_mutex_lock(&osp->lock);
+        ex = osp->backlog;
+        if (ex && (!ex->length || osp->inflight < osp->window)
+                && (!ex->not_before || ex->not_before <= now_ns())) {
+            osp->backlog = ex->queued;
+            if (!osp->backlog)
+                osp->backlog_tail = &osp->backlog;
+            if (ex->length)
+                osp->inflight++;
+            ex->state = EX_ARMED;
+        } else {
+            ex = NULL;
+        }
+        pthread_mutex_unlock(&osp->lock);
+        if (!ex)
+            break;
+        launch(osp, ex);
+    }
+}
+
+/* Run callbacks of completed asynchronous exchanges. Returns count. */
+static int run_completions(osp_t *osp)
 {
-    log_line('>', &osp->output, length);
-    return driver_send(osp->driver, &osp->output, length);
+    struct exchange *ex, **link;
+    int count = 0;
+    int result;
+
+    for (;;) {
+        pthread_mutex_lock(&osp->lock);
+        for (link = &osp->completed; (ex = *link); link = &ex->next) {
+            if (ex->launched)
+                break;
+        }
+        if (ex) {
+            *link = ex->next;
+            if (!*link)
+                osp->completed_tail = link;
+        }
+        pthread_mutex_unlock(&osp->lock);
+        if (!ex)
+            break;
+
+        result = ex->finish ? ex->finish(ex, ex->result) : ex->result;
+        ex->callback(ex->cb_arg, result);
+        pthread_cond_destroy(&ex->signal);
+        free(ex);
+        count++;
+    }
+    return count;
+}
+
+/* After exchanges finished or freed window slots. Completions run here
+ * unless application polls for them. */
+static void settle(osp_t *osp)
+{
+    uint64_t one = 1;
+    bool completed;
+
+    pump(osp);
+    if (osp->completion_fd < 0) {
+        run_completions(osp);
+        return;
+    }
+    pthread_mutex_lock(&osp->lock);
+    completed = osp->completed != NULL;
+    pthread_mutex_unlock(&osp->lock);
+    if (completed && write(osp->completion_fd, &one, sizeof(one)) < 0)
+        syslog(LOG_WARNING, "completion fd: %s\n", strerror(errno));
+}
+
+/* With osp->lock held. Start-up passed phase now. */
+static void startup_reached(osp_t *osp, int phase)
+{
+    osp_startup_report_t *report = osp->startup;
+    if (!report || report->reached & (1u << phase))
+        return;
+    report->reached |= 1u << phase;
+    report->at_us[phase] = (now_ns() - osp->startup_begin) / 1000;
+}
+
+/* With osp->lock held. Error of cached position, m, grown since fix. */
+static void cache_error(osp_t *osp, int64_t now, uint32_t *err_h, uint32_t *err_v)
+{
+    uint64_t grown = 0;
+    if (now > osp->cache.stamp)
+        grown = (now - osp->cache.stamp) / NSEC_PER_SEC * OSP_POSITION_GROWTH;
+    *err_h = osp->cache.position.err_h + grown;
+    *err_v = osp->cache.position.err_v + grown;
 }
 
 /* OSP internal callbacks */
-static void osp_hw_config_request(osp_t *osp)
+static void osp_hw_config_request(osp_t *osp, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
 {
-    memset(&osp->output.mid214, 0, sizeof(struct mid214));
-    osp->output.mid = 214;
-    osp->output.mid214.hw_config.rtc_available = true;
-    osp->output.mid214.hw_config.rtc_internal = true;
-    osp->output.mid214.hw_config.coarse_time_ta = true;
-    osp_send(osp, 1 + sizeof(struct mid214));
+    uint8_t tx[OSP_MID214_LEN];
+    size_t length = osp_build_hw_config(tx, OSP_HW_RTC_AVAILABLE
+            | OSP_HW_RTC_INTERNAL | OSP_HW_COARSE_TIME_TA);
+    osp_send(osp, tx, length);
 }
 
 static void osp_position_transfer_request(osp_t *osp)
 {
-    if (osp->cache.valid) {
-        memset(&osp->output.mid215, 0, sizeof(struct mid215));
-        osp->output.mid = 215;
-        osp->output.mid215.sid = 1;
+    uint8_t tx[OSP_MID215_SID1_LEN];
+    size_t length;
+    osp_position_t position;
+    uint32_t err_h, err_v;
+    bool valid;
+
+    pthread_mutex_lock(&osp->lock);
+    valid = osp->cache.valid;
+    position = osp->cache.position;
+    cache_error(osp, now_ns(), &err_h, &err_v);
+    pthread_mutex_unlock(&osp->lock);
 
-        int64_t lat = osp->cache.position.lat;
+    if (valid) {
+        int64_t lat = position.lat;
         lat <<= 32;
         lat /= 180*10000000ll;
-        int64_t lon = osp->cache.position.lon;
+        int64_t lon = position.lon;
         lon <<=32;
         lon /= 360*10000000ll;
-        int32_t alt = osp->cache.position.alt;
+        int32_t alt = position.alt;
         alt /= 100;
         alt += 500;
         alt *= 10;
-        osp->output.mid215.sid1.latitude = htobe32((int32_t)lat);
-        osp->output.mid215.sid1.longitude =  htobe32((int32_t)lon);
-        osp->output.mid215.sid1.altitude = htobe16((int16_t)alt);
-        osp->output.mid215.sid1.est_hor_err = 0x50; /* ~120m */
-        osp->output.mid215.sid1.est_ver_err = htobe16(100);
-        osp->output.mid215.sid1.use_alt_aiding = false;
-        osp_send(osp, 1 + 1 + sizeof(osp->output.mid215.sid1));
+        length = osp_build_position(tx, lat, lon, alt,
+                osp_uncertainty_code(err_h),
+                err_v < INT16_MAX ? err_v : INT16_MAX, false);
+        osp_send(osp, tx, length);
     } else {
-        memset(&osp->output.mid216, 0, sizeof(struct mid216));
-        osp->output.mid = 216;
-        osp->output.mid216.sid = 2;
-        osp->output.mid216.rmid = 73;
-        osp->output.mid216.rsid = 1;
-        osp->output.mid216.reason = 0x04;
-        osp_send(osp, 1 + sizeof(struct mid216));
+        length = osp_build_reject(tx, 73, 1, 0x04);
+        osp_send(osp, tx, length);
         syslog(LOG_DEBUG, "skip. cache-invalid\n");
     }
 }
 
-static void osp_time_transfer_request(osp_t *osp)
+static void osp_time_transfer_request(osp_t *osp, const osp_stamp_t *arrival)
 {
-    time_t utc;
+    struct timespec now;
+    int64_t utc;
     uint64_t result;
     uint32_t tow;
     uint16_t wn;
-    uint32_t tow_l;
-    uint8_t tow_h;
-    memset(&osp->output.mid215, 0, sizeof(struct mid215));
-
-    time(&utc);
-    utc_to_gps(&wn, &tow, utc);
-    result = (uint64_t)tow * 1000000l;
-
-    tow_l = result & 0xFFFFFFFFl;
-    tow_h = (result>>32) & 0xFFl;
-
-    osp->output.mid = 215;
-    osp->output.mid215.sid = 2;
-    osp->output.mid215.sid2.tt_type = 0; /* Coarse*/
-    osp->output.mid215.sid2.week_number = htobe16(wn);
-    osp->output.mid215.sid2.gps_time[0] = tow_h;
-    *(uint32_t*)&osp->output.mid215.sid2.gps_time[1] = htobe32(tow_l);
-    *(uint16_t*)&osp->output.mid215.sid2.deltat_utc[1] = htobe16(18*1000);
-    osp->output.mid215.sid2.time_accuracy = 0xB0; /* shitty 1byte float */
-
-    osp_send(osp, 1 + 1 + sizeof(osp->output.mid215.sid2));
+    uint8_t tx[OSP_MID215_SID2_LEN];
+    size_t length;
+
+    /* Wall clock read when request arrived, moved by time the request was
+     * queued, as measured by monotonic clock. Immune to clock steps. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    utc = timespec_ns(&arrival->real) + timespec_ns(&now) - timespec_ns(&arrival->mono);
+    utc_to_gps(&wn, &tow, utc / NSEC_PER_SEC);
+    result = (uint64_t)tow * 1000000l + (utc % NSEC_PER_SEC) / 1000;
+
+    length = osp_build_time(tx, 0 /* Coarse */, wn, result, 18*1000,
+            0xB0 /* shitty 1byte float */);
+    osp_send(osp, tx, length);
 }
 
-static void osp_transfer_request(osp_t *osp)
+static void osp_transfer_request(osp_t *osp, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
 {
-    uint8_t sid = osp->input.mid73.sid;
+    uint8_t sid = msg->mid73.sid;
     if (sid == 1)
         osp_position_transfer_request(osp);
     else if (sid == 2)
-        osp_time_transfer_request(osp);
-    else
+        osp_time_transfer_request(osp, &view->arrival);
+    else {
         syslog(LOG_WARNING, "unhandled transfer request: %d\n", sid);
+        return;
+    }
+    pthread_mutex_lock(&osp->lock);
+    startup_reached(osp, sid == 1 ? OSP_STARTUP_POSITION : OSP_STARTUP_TIME);
+    pthread_mutex_unlock(&osp->lock);
+}
+
+static void publish_fix(osp_t *osp, const osp_mid41_t *nav,
+        const osp_frame_view_t *view)
+{
+    uint64_t seq = osp->fix_seq;
+
+    __atomic_store_n(&osp->fix_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    osp->fix.nav = *nav;
+    osp->fix.arrival = view->arrival;
+    osp->fix.number = seq / 2 + 1;
+    __atomic_store_n(&osp->fix_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline int64_t gps_ms(uint16_t week, uint32_t tow)
+{
+    return (int64_t)week * SECONDS_PER_WEEK * 1000 + tow;
+}
+
+/* i-th oldest fix */
+static osp_history_fix_t* history_fix(struct history *h, unsigned i)
+{
+    return &h->fixes[(h->next + h->depth - h->count + i) % h->depth];
+}
+
+/* Fix of GPS time, new or the newest one when MID2 and MID41 of the same
+ * fix meet, NULL for fix older than the newest one. Called with history
+ * lock held. */
+static osp_history_fix_t* history_slot(struct history *h, uint16_t week,
+        uint32_t tow, const osp_stamp_t *arrival)
+{
+    osp_history_fix_t *fix;
+    int64_t step;
+
+    if (h->count) {
+        fix = history_fix(h, h->count - 1);
+        step = gps_ms(week, tow) - gps_ms(fix->week, fix->tow);
+        if (step >= -HISTORY_MERGE && step <= HISTORY_MERGE)
+            return fix;
+        /* receiver time went back, as after reset */
+        if (step < -HISTORY_RESTART || (step < 0 && week != fix->week))
+            h->count = 0;
+        else if (step < 0)
+            return NULL;
+    }
+    fix = &h->fixes[h->next];
+    memset(fix, 0, sizeof(*fix));
+    fix->week = week;
+    fix->tow = tow;
+    fix->arrival = *arrival;
+    h->next = (h->next + 1) % h->depth;
+    if (h->count < h->depth)
+        h->count++;
+    return fix;
+}
+
+static void history_geodetic(osp_t *osp, const osp_mid41_t *nav,
+        const osp_frame_view_t *view)
+{
+    struct history *h = osp->history;
+    osp_history_fix_t *fix;
+
+    if (!h || nav->nav_valid || !nav->svs_in_fix)
+        return;
+    pthread_mutex_lock(&h->lock);
+    if (!(fix = history_slot(h, nav->extended_week_no, nav->tow, &view->arrival))) {
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+    /* finer than TOW of MID2 */
+    fix->week = nav->extended_week_no;
+    fix->tow = nav->tow;
+    fix->geodetic = true;
+    fix->lat = nav->latitude;
+    fix->lon = nav->longitude;
+    fix->alt = nav->altitude_msl;
+    fix->speed = nav->speed_over_ground;
+    fix->course = nav->course_over_ground;
+    fix->climb_rate = nav->climb_rate;
+    fix->err_h = nav->est_h_pos_error;
+    fix->err_v = nav->est_v_pos_error;
+    fix->svs_in_fix = nav->svs_in_fix;
+    pthread_mutex_unlock(&h->lock);
+}
+
+static void osp_nav_data(osp_t *osp, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
+{
+    const osp_mid2_t *mid = &msg->mid2;
+    struct history *h = osp->history;
+    osp_history_fix_t *fix;
+    int week = -1;
+
+    if (!h || !mid->pmode)
+        return;
+    pthread_mutex_lock(&h->lock);
+    /* MID2 may carry week modulo 1024, newest fix or latest MID41 tells
+     * which one. Until MID41 gave full week, MID2 is not kept. */
+    if (h->count)
+        week = history_fix(h, h->count - 1)->week;
+    else if (osp->fix_seq)
+        week = osp->fix.nav.extended_week_no;
+    if (week < 0 || week % 1024 != mid->gps_week % 1024
+            || !(fix = history_slot(h, week, mid->gps_tow * 10, &view->arrival))) {
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+    fix->ecef = true;
+    fix->x = mid->x;
+    fix->y = mid->y;
+    fix->z = mid->z;
+    fix->vx = mid->vx;
+    fix->vy = mid->vy;
+    fix->vz = mid->vz;
+    if (!fix->svs_in_fix)
+        fix->svs_in_fix = mid->svs_in_fix;
+    pthread_mutex_unlock(&h->lock);
 }
 
-static void osp_geodetic_nav_data(osp_t *osp)
+static void osp_geodetic_nav_data(osp_t *osp, const osp_msg_t *msg,
+        const osp_frame_view_t *view)
 {
+    const osp_mid41_t *mid = &msg->mid41;
     struct tm utc = {
-        .tm_sec = be16toh(osp->input.mid41.utc.second)/1000,
-        .tm_min = osp->input.mid41.utc.minute,
-        .tm_hour = osp->input.mid41.utc.hour,
-        .tm_mday = osp->input.mid41.utc.day,
-        .tm_mon = osp->input.mid41.utc.month - 1,
-        .tm_year = be16toh(osp->input.mid41.utc.year) - 1900,
+        .tm_sec = mid->utc.second/1000,
+        .tm_min = mid->utc.minute,
+        .tm_hour = mid->utc.hour,
+        .tm_mday = mid->utc.day,
+        .tm_mon = mid->utc.month - 1,
+        .tm_year = mid->utc.year - 1900,
     };
-    struct mid41 *mid = &osp->input.mid41;
 
-    if (osp->input.mid41.svs_in_fix) {
-        osp->cache.clock_drift = be32toh(mid->clock_drift);
-    }
-#if 0
-    uint32_t err_h = be32toh(mid->est_h_pos_error)/100;
-    uint32_t err_v = be32toh(mid->est_v_pos_error)/100;
+    uint32_t err_h = mid->est_h_pos_error/100;
+    uint32_t err_v = mid->est_v_pos_error/100;
+    uint32_t cached_h, cached_v;
+    int64_t now = timespec_ns(&view->arrival.mono);
+
+    publish_fix(osp, mid, view);
+    history_geodetic(osp, mid, view);
 
-    if (err_h < 200) {
-        osp->cache.position.lat = be32toh(mid->latitude);
-        osp->cache.position.lon = be32toh(mid->longitude);
-        osp->cache.position.alt = be32toh(mid->altitude_msl);
+    pthread_mutex_lock(&osp->lock);
+    if (mid->svs_in_fix) {
+        osp->cache.clock_drift = mid->clock_drift;
+    }
+    /* Valid fix good enough for aiding, and not worse than cached one has
+     * become since */
+    cache_error(osp, now, &cached_h, &cached_v);
+    if (!mid->nav_valid && mid->svs_in_fix
+            && err_h < CACHE_MAX_ERR_H && err_v < CACHE_MAX_ERR_V
+            && (!osp->cache.valid || err_h <= cached_h)) {
+        osp->cache.position.lat = mid->latitude;
+        osp->cache.position.lon = mid->longitude;
+        osp->cache.position.alt = mid->altitude_msl;
         osp->cache.position.err_h = err_h;
         osp->cache.position.err_v = err_v;
+        osp->cache.stamp = now;
+        osp->cache.valid = true;
     }
-#endif
+    pthread_mutex_unlock(&osp->lock);
 
     syslog(LOG_DEBUG, "[%02d/%02d/%02d %02d:%02d:%02d] " \
            "nav valid: 0x%04x, nav type: 0x%04x, in fix: %d (%d, %d, %d)(~%d)\n",
             utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
             utc.tm_hour, utc.tm_min, utc.tm_sec,
-            be16toh(mid->nav_valid.word),
-            be16toh(mid->nav_type.word),
+            mid->nav_valid,
+            mid->nav_type,
             mid->svs_in_fix,
-            be32toh(mid->latitude),
-            be32toh(mid->longitude),
-            be32toh(mid->altitude_msl),
-            be32toh(mid->est_h_pos_error)
+            mid->latitude,
+            mid->longitude,
+            mid->altitude_msl,
+            mid->est_h_pos_error
             );
 
     /* mktime is broken. Substract 1 from month */
@@ -222,344 +876,929 @@ static void osp_geodetic_nav_data(osp_t *osp)
     if (osp->callbacks && osp->callbacks->location)
         osp->callbacks->location(osp->arg,
                 mid->svs_in_fix,
-                be32toh(mid->latitude),
-                be32toh(mid->longitude),
+                mid->latitude,
+                mid->longitude,
                 timestamp);
 }
 
-static void osp_measure_nav_data_out(osp_t *osp)
+typedef void (*handler_f)(osp_t *osp, const osp_msg_t *msg,
+        const osp_frame_view_t *view);
+
+/* Messages library reacts to itself, decoded whether subscribed or not */
+static const handler_f handlers[256] = {
+    [2] = osp_nav_data,
+    [41] = osp_geodetic_nav_data,
+    [71] = osp_hw_config_request,
+    [73] = osp_transfer_request,
+};
+
+static void osp_dispatch(osp_t *osp, const osp_frame_view_t *view)
 {
-#if 0
-    struct mid2 *mid = &osp->input.mid2;
-    printf("cache: %d, location updated (%d, %d, %d)\n",
-            mid->svs_in_fix);
-#endif
+    const osp_frame_t *frame = view->data;
+    size_t length = view->length;
+    handler_f handler;
+    struct subscription *sub;
+    osp_msg_t msg;
+    bool decoded = false;
+    int sid;
+    int expired, scanned;
+
+    capture(osp, OSP_INCOMING, &view->arrival.mono, frame, length);
+    if (osp->callbacks && osp->callbacks->frame)
+        osp->callbacks->frame(osp->arg, view);
+
+    /* Requests of receiver are answered before commands waiting for them
+     * wake up, so whatever they send next goes after the answer. Nothing
+     * is decoded for MIDs no one listens to. */
+    handler = handlers[frame->mid];
+    if (handler) {
+        decoded = !osp_decode(frame, length, &msg);
+        if (decoded)
+            handler(osp, &msg, view);
+    }
+
+    expired = expire(osp);
+    scanned = scan(osp, frame, length);
+    if (expired || scanned == SCAN_FINISHED)
+        settle(osp);
+    if (scanned == SCAN_CONSUMED)
+        return;
+
+    pthread_rwlock_rdlock(&osp->subs_lock);
+    sub = osp->subs[frame->mid];
+    if (!sub)
+        goto out;
+    if (!decoded && osp_decode(frame, length, &msg)) {
+        syslog(LOG_DEBUG, "mid %d: unexpected length %zu\n", frame->mid, length);
+        goto out;
+    }
+
+    /* MIDs without SID match subscribers of any */
+    sid = osp_has_sid(frame->mid) && length > 1
+        ? ((const uint8_t*)frame)[1] : OSP_SID_ANY;
+    for (; sub; sub = sub->next) {
+        if (sub->sid == OSP_SID_ANY || sub->sid == sid)
+            sub->cb(sub->arg, &msg, view);
+    }
+out:
+    pthread_rwlock_unlock(&osp->subs_lock);
 }
 
-static void osp_measure_tracker_data_out(osp_t *osp)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+
+/* Receiving thread. Queue frame, dropping oldest or waiting for room when
+ * queue is full. */
+static void enqueue(osp_t *osp, const osp_frame_view_t *view)
 {
-    char buf[512];
-    int l = 0;
-    struct mid4 *mid = &osp->input.mid4;
-    int i, j;
-    l += sprintf(buf + l, "CN0: ");
-    for(i = 0; i < mid->chans; i++) {
-        int avg = 0;
-        for(j = 0; j < 10; j++)
-            avg += mid->channel[i].CN0[j];
-        avg /= 10;
-        uint16_t state = be16toh(mid->channel[i].state);
-        struct mid4_ch_state *flags = (struct mid4_ch_state*)&state;
-        l += sprintf(buf + l, "%d(%04x, %s, %d), ", mid->channel[i].svid,
-                mid->channel[i].state,
-                flags->ephemeris ? "eph" : "!eph",
-                avg);
+    struct dispatch_queue *q = osp->queue;
+    struct queued_frame *entry;
+    uint64_t tail = q->tail;
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    while (tail - head >= q->depth) {
+        if (q->policy == OSP_QUEUE_DROP_OLDEST) {
+            entry = &q->frames[head % q->depth];
+            if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                if (entry->view.slot)
+                    osp_frame_release(&entry->view);
+                STAT_SET(q->stats.dropped, q->stats.dropped + 1);
+                head++;
+            }
+            continue;
+        }
+        STAT_SET(q->stats.blocked, q->stats.blocked + 1);
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->reader_waits, 1, __ATOMIC_SEQ_CST);
+        while (tail - (head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST)) >= q->depth)
+            pthread_cond_wait(&q->nonfull, &q->lock);
+        __atomic_store_n(&q->reader_waits, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    entry = &q->frames[tail % q->depth];
+    entry->view = *view;
+    if (view->slot) {
+        osp_frame_hold(view);
+    } else {
+        memcpy(&entry->frame, view->data, view->length);
+        entry->view.data = &entry->frame;
+    }
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    STAT_SET(q->stats.queued, q->stats.queued + 1);
+    if (tail + 1 - head > q->stats.high_water)
+        STAT_SET(q->stats.high_water, tail + 1 - head);
+
+    if (__atomic_load_n(&q->worker_waits, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->nonempty);
+        pthread_mutex_unlock(&q->lock);
     }
-    l += sprintf(buf + l, "\n");
-    syslog(LOG_DEBUG, buf);
 }
 
-static void osp_clock_status_data(osp_t *osp)
+static void* dispatch_worker(void *arg)
 {
-}
+    osp_t *osp = arg;
+    struct dispatch_queue *q = osp->queue;
+    struct queued_frame *entry;
+    struct queued_frame copy, *local = &copy;
+    uint64_t head;
+    size_t length;
+
+    for (;;) {
+        head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&q->lock);
+            __atomic_store_n(&q->worker_waits, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST)
+                    == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) && !q->stop)
+                pthread_cond_wait(&q->nonempty, &q->lock);
+            __atomic_store_n(&q->worker_waits, 0, __ATOMIC_RELAXED);
+            /* stopped once receiving thread is, and all is dispatched */
+            if (q->stop && __atomic_load_n(&q->head, __ATOMIC_SEQ_CST)
+                    == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_unlock(&q->lock);
+                break;
+            }
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
 
+        /* Copy first, frame is ours only if head did not move meanwhile */
+        entry = &q->frames[head % q->depth];
+        local->view = entry->view;
+        if (!local->view.slot) {
+            length = local->view.length;
+            if (length > sizeof(osp_frame_t))
+                length = sizeof(osp_frame_t);
+            memcpy(&local->frame, &entry->frame, length);
+            local->view.data = &local->frame;
+        }
+        if (!__atomic_compare_exchange_n(&q->head, &head, head + 1, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        if (__atomic_load_n(&q->reader_waits, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&q->lock);
+            pthread_cond_signal(&q->nonfull);
+            pthread_mutex_unlock(&q->lock);
+        }
 
-static void osp_visible_list(osp_t *osp)
-{
-    int i;
-    printf("Number of visible satellites: %d\n", osp->input.mid13.svs);
-    for(i = 0; i < osp->input.mid13.svs; i++)
-        printf("SVID: %d, (%d, %d)\n",
-                osp->input.mid13.ch[i].svid,
-                be16toh(osp->input.mid13.ch[i].azimuth),
-                be16toh(osp->input.mid13.ch[i].elevation));
+        osp_dispatch(osp, &local->view);
+        if (local->view.slot)
+            osp_frame_release(&local->view);
+    }
+    return NULL;
 }
 
-static void osp_nav_lib_data(osp_t *osp)
+static void deliver(osp_t *osp, const osp_frame_view_t *view)
 {
+    if (osp->queue)
+        enqueue(osp, view);
+    else
+        osp_dispatch(osp, view);
 }
 
-static void osp_dispatch(osp_t *osp, osp_frame_t *frame, size_t length)
+static void adapter_osp_dispatch(void *arg, void* payload, size_t len)
 {
-    log_line('<', &osp->input, length);
-    if (osp->scanner) {
-        int srv = osp->scanner(osp, osp->scan_arg, frame, length);
-        if (srv == SCAN_FINISHED) {
-            pthread_mutex_lock(&osp->lock);
-            pthread_cond_signal(&osp->signal);
-            pthread_mutex_unlock(&osp->lock);
-        } else if (srv == SCAN_CONSUMED) {
-            return;
-        }
-    }
+    osp_t *osp = (osp_t*)arg;
+    osp_frame_view_t view;
 
-    switch(frame->mid) {
-        case 2:
-            osp_measure_nav_data_out(osp);
-            break;
-        case 4:
-            osp_measure_tracker_data_out(osp);
-            break;
-        case 7:
-            osp_clock_status_data(osp);
-            break;
-        case 13:
-            osp_visible_list(osp);
-            break;
-        case 28:
-            osp_nav_lib_data(osp);
-            break;
-        case 41:
-            osp_geodetic_nav_data(osp);
-            break;
-        case 71:
-            osp_hw_config_request(osp);
-            break;
-        case 73:
-            osp_transfer_request(osp);
-            break;
+    if (osp->views) {
+        deliver(osp, (osp_frame_view_t*)payload);
+        osp_frame_release((osp_frame_view_t*)payload);
+    } else {
+        view.data = payload;
+        view.length = len;
+        view.slot = NULL;
+        if (osp->transport) {
+            osp_transport_arrival(osp->transport, &view.arrival);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &view.arrival.mono);
+            clock_gettime(CLOCK_REALTIME, &view.arrival.real);
+        }
+        deliver(osp, &view);
     }
 }
 
-static void adapter_osp_dispatch(void *arg, void* payload, size_t len)
+/* Frame completed by bytes fed */
+static void feed_frame(void *arg, const uint8_t *payload, size_t length,
+        const osp_stamp_t *arrival)
 {
-    osp_dispatch((osp_t*)arg, (osp_frame_t*)payload, len);
+    osp_t *osp = arg;
+    osp_frame_view_t view;
+
+    view.data = payload;
+    view.length = length;
+    view.arrival = *arrival;
+    view.slot = NULL;
+    deliver(osp, &view);
 }
 
-osp_t* osp_alloc(driver_t* driver, const osp_callbacks_t *cb, void *cb_arg)
+static osp_t* osp_new(const osp_callbacks_t *cb, void *cb_arg)
 {
+    pthread_condattr_t attr;
+    int mid;
     osp_t *osp = malloc(sizeof(osp_t));
     if (!osp) {
         errno = ENOMEM;
         return NULL;
     }
     memset(osp, 0, sizeof(osp_t));
-    osp->driver = driver;
     osp->callbacks = cb;
     osp->arg = cb_arg;
     pthread_mutex_init(&osp->lock, NULL);
-    pthread_cond_init(&osp->signal, NULL);
+    pthread_mutex_init(&osp->send_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&osp->room, &attr);
+    pthread_condattr_destroy(&attr);
+    osp->window = OSP_WINDOW;
+    for (mid = 0; mid < 256; mid++)
+        osp->timeouts[mid] = EXCHANGE_TIMEOUT;
+    osp->timeouts[18] = READY_TIMEOUT;
+    osp->backlog_tail = &osp->backlog;
+    osp->completed_tail = &osp->completed;
+    osp->completion_fd = -1;
+    pthread_rwlock_init(&osp->subs_lock, NULL);
+    return osp;
+}
+
+osp_t* osp_alloc(driver_t* driver, const osp_callbacks_t *cb, void *cb_arg)
+{
+    osp_t *osp = osp_new(cb, cb_arg);
+    if (!osp)
+        return NULL;
+    osp->driver = driver;
     /* configure driver */
     driver_buffer(osp->driver, &osp->input, sizeof(osp->input));
     driver_dispatcher(osp->driver, adapter_osp_dispatch, osp);
     return osp;
 }
 
+osp_t* osp_alloc_sink(osp_sink_f sink, void *sink_arg,
+        const osp_callbacks_t *cb, void *cb_arg)
+{
+    osp_t *osp;
+
+    if (!sink) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(osp = osp_new(cb, cb_arg)))
+        return NULL;
+    if (!(osp->framer = osp_framer_alloc())) {
+        osp_free(osp);
+        return NULL;
+    }
+    osp->sink = sink;
+    osp->sink_arg = sink_arg;
+    return osp;
+}
+
+int osp_feed(osp_t *osp, const void *bytes, size_t length)
+{
+    osp_stamp_t stamp;
+
+    if (!osp->framer) {
+        errno = EINVAL;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stamp.mono);
+    clock_gettime(CLOCK_REALTIME, &stamp.real);
+    /* frames are queued for dispatch worker as osp_frame_t */
+    osp_framer_feed(osp->framer, bytes, length, sizeof(osp_frame_t), &stamp,
+            feed_frame, osp);
+    return 0;
+}
+
+void osp_feed_nmea(osp_t *osp, osp_nmea_f cb, void *arg)
+{
+    if (osp->framer)
+        osp_framer_nmea(osp->framer, cb, arg);
+}
+
+void osp_feed_stats(osp_t *osp, osp_transport_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!osp->framer)
+        return;
+    osp_framer_stats(osp->framer, stats);
+    stats->bytes_out = __atomic_load_n(&osp->bytes_out, __ATOMIC_RELAXED);
+}
+
+void osp_free(osp_t *osp)
+{
+    struct subscription *sub;
+    struct exchange *ex;
+    int mid;
+
+    /* Unfinished asynchronous commands are dropped without completion */
+    while ((ex = osp->pending)) {
+        osp->pending = ex->next;
+        free(ex);
+    }
+    while ((ex = osp->completed)) {
+        osp->completed = ex->next;
+        free(ex);
+    }
+    if (osp->completion_fd >= 0)
+        close(osp->completion_fd);
+    if (osp->queue) {
+        pthread_mutex_destroy(&osp->queue->lock);
+        pthread_cond_destroy(&osp->queue->nonempty);
+        pthread_cond_destroy(&osp->queue->nonfull);
+        free(osp->queue->frames);
+        free(osp->queue);
+    }
+    if (osp->framer)
+        osp_framer_free(osp->framer);
+    if (osp->history) {
+        pthread_mutex_destroy(&osp->history->lock);
+        free(osp->history->fixes);
+        free(osp->history);
+    }
+
+    for (mid = 0; mid < 256; mid++) {
+        while ((sub = osp->subs[mid])) {
+            osp->subs[mid] = sub->next;
+            free(sub);
+        }
+    }
+    pthread_rwlock_destroy(&osp->subs_lock);
+    pthread_cond_destroy(&osp->room);
+    pthread_mutex_destroy(&osp->send_lock);
+    pthread_mutex_destroy(&osp->lock);
+    free(osp);
+}
+
+int osp_subscribe(osp_t *osp, uint8_t mid, int sid, osp_msg_f cb, void *arg)
+{
+    struct subscription *sub, **tail;
+
+    if (!cb) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!osp_decodable(mid)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (sid != OSP_SID_ANY && !osp_has_sid(mid)) {
+        errno = EINVAL;
+        return -1;
+    }
+    sub = malloc(sizeof(*sub));
+    if (!sub) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sub->next = NULL;
+    sub->sid = sid;
+    sub->cb = cb;
+    sub->arg = arg;
+
+    /* Appended, subscribers are called in order they came */
+    pthread_rwlock_wrlock(&osp->subs_lock);
+    for (tail = &osp->subs[mid]; *tail; tail = &(*tail)->next);
+    *tail = sub;
+    pthread_rwlock_unlock(&osp->subs_lock);
+    return 0;
+}
+
+int osp_unsubscribe(osp_t *osp, uint8_t mid, osp_msg_f cb, void *arg)
+{
+    struct subscription *sub = NULL, **link;
+
+    pthread_rwlock_wrlock(&osp->subs_lock);
+    for (link = &osp->subs[mid]; *link; link = &(*link)->next) {
+        if ((*link)->cb == cb && (*link)->arg == arg) {
+            sub = *link;
+            *link = sub->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&osp->subs_lock);
+
+    if (!sub) {
+        errno = ENOENT;
+        return -1;
+    }
+    free(sub);
+    return 0;
+}
+
+void osp_set_transport(osp_t *osp, io_t *transport)
+{
+    osp->transport = transport;
+}
+
+int osp_zero_copy(osp_t *osp, io_t *transport, unsigned buffers)
+{
+    if (!osp->driver) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (osp_transport_views(transport, buffers))
+        return -1;
+    osp->transport = transport;
+    osp->views = true;
+    driver_buffer(osp->driver, &osp->view, sizeof(osp->view));
+    return 0;
+}
+
+void osp_set_capture(osp_t *osp, osp_capture_t *capture)
+{
+    __atomic_store_n(&osp->capture, capture, __ATOMIC_RELEASE);
+}
+
+int osp_dispatch_worker(osp_t *osp, unsigned depth, int policy)
+{
+    struct dispatch_queue *q;
+
+    if (!depth || (policy != OSP_QUEUE_DROP_OLDEST && policy != OSP_QUEUE_BLOCK)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (osp->queue || osp->started) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!(q = calloc(1, sizeof(*q))) || !(q->frames = calloc(depth, sizeof(*q->frames)))) {
+        free(q);
+        errno = ENOMEM;
+        return -1;
+    }
+    q->depth = depth;
+    q->policy = policy;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->nonempty, NULL);
+    pthread_cond_init(&q->nonfull, NULL);
+    osp->queue = q;
+    return 0;
+}
+
+void osp_queue_stats(osp_t *osp, osp_queue_stats_t *stats)
+{
+    struct dispatch_queue *q = osp->queue;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!q)
+        return;
+    stats->queued = __atomic_load_n(&q->stats.queued, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&q->stats.dropped, __ATOMIC_RELAXED);
+    stats->blocked = __atomic_load_n(&q->stats.blocked, __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&q->stats.high_water, __ATOMIC_RELAXED);
+}
+
 int osp_start(osp_t *osp)
 {
+    if (osp->queue) {
+        osp->queue->stop = false;
+        if ((errno = pthread_create(&osp->queue->worker, NULL, dispatch_worker, osp)))
+            return -1;
+    }
+    osp->started = true;
     /* TODO: ignore gps incoming data till initialization */
-    driver_enable(osp->driver);
+    if (osp->driver)
+        driver_enable(osp->driver);
+    return 0;
+}
+
+inline int osp_running(osp_t *osp)
+{
+}
+
+int osp_stop(osp_t *osp)
+{
+    if (osp->driver)
+        driver_disable(osp->driver);
+    /* frames already queued are still dispatched */
+    if (osp->queue) {
+        pthread_mutex_lock(&osp->queue->lock);
+        osp->queue->stop = true;
+        pthread_cond_signal(&osp->queue->nonempty);
+        pthread_mutex_unlock(&osp->queue->lock);
+        pthread_join(osp->queue->worker, NULL);
+    }
+    osp->started = false;
+    return 0;
+}
+
+/* Send frame of exchange once window has room. Room not freed within time
+ * exchange has for response means receiver does not answer; exchange then
+ * finishes with ETIMEDOUT, which is returned. Exchange without frame only
+ * awaits response and is armed at once, taking no slot. */
+static int submit(osp_t *osp, struct exchange *ex)
+{
+    int64_t until = now_ns() + exchange_timeout(osp, ex);
+    int64_t now, wake;
+    struct timespec tow;
+
+    pthread_mutex_lock(&osp->lock);
+    while (ex->length && osp->inflight >= osp->window
+            && (now = now_ns()) < until) {
+        /* Asynchronous exchanges holding window past their deadline are
+         * timed out here, as silent receiver sends no frame to do it */
+        wake = armed_deadline(osp);
+        if (wake <= now) {
+            pthread_mutex_unlock(&osp->lock);
+            if (expire(osp))
+                settle(osp);
+            pthread_mutex_lock(&osp->lock);
+            continue;
+        }
+        if (wake > until)
+            wake = until;
+        tow.tv_sec = wake / NSEC_PER_SEC;
+        tow.tv_nsec = wake % NSEC_PER_SEC;
+        pthread_cond_timedwait(&osp->room, &osp->lock, &tow);
+    }
+    if (ex->length && osp->inflight >= osp->window) {
+        ex->state = EX_DONE;
+        ex->result = ETIMEDOUT;
+        pthread_mutex_unlock(&osp->lock);
+        return ETIMEDOUT;
+    }
+    if (ex->length)
+        osp->inflight++;
+    ex->state = EX_ARMED;
+    pthread_mutex_unlock(&osp->lock);
+
+    launch(osp, ex);
+    return 0;
+}
+
+/* Wait for submitted exchange to finish, resubmit it as retry policy
+ * says if it times out */
+static int wait_for(osp_t *osp, struct exchange *ex)
+{
+    int retval;
+    int64_t delay;
+    struct timespec tow;
+
+    for (;;) {
+        retval = 0;
+        pthread_mutex_lock(&osp->lock);
+        tow.tv_sec = ex->deadline / NSEC_PER_SEC;
+        tow.tv_nsec = ex->deadline % NSEC_PER_SEC;
+        while (!retval && ex->state != EX_DONE)
+            retval = pthread_cond_timedwait(&ex->signal, &osp->lock, &tow);
+        if (ex->state != EX_DONE)
+            complete(osp, ex, retval);
+        retval = ex->result;
+        delay = -1;
+        if (retval == ETIMEDOUT && ex->attempts < osp->retry.retries) {
+            delay = backoff(&osp->retry, ++ex->attempts);
+            rewind_exchange(ex);
+        }
+        pthread_mutex_unlock(&osp->lock);
+        expire(osp);
+        settle(osp);
+
+        if (delay < 0)
+            break;
+        syslog(LOG_DEBUG, "mid %d: retry %d\n",
+                ex->length ? ex->tx[0] : ex->mids[0], ex->attempts);
+        tow.tv_sec = delay / NSEC_PER_SEC;
+        tow.tv_nsec = delay % NSEC_PER_SEC;
+        nanosleep(&tow, NULL);
+        submit(osp, ex);
+    }
+    pthread_cond_destroy(&ex->signal);
+    return ex->finish ? ex->finish(ex, retval) : retval;
+}
+
+static int run(osp_t *osp, struct exchange *ex)
+{
+    /* exchange not sent is finished already */
+    submit(osp, ex);
+    return wait_for(osp, ex);
+}
+
+/* Queue exchange allocated with exchange_alloc(), done is called with
+ * result once it finishes */
+static int run_async(osp_t *osp, struct exchange *ex, osp_done_f done, void *arg)
+{
+    ex->callback = done;
+    ex->cb_arg = arg;
+
+    pthread_mutex_lock(&osp->lock);
+    ex->next = osp->pending;
+    osp->pending = ex;
+    *osp->backlog_tail = ex;
+    osp->backlog_tail = &ex->queued;
+    pthread_mutex_unlock(&osp->lock);
+
+    expire(osp);
+    settle(osp);
     return 0;
 }
 
-inline int osp_running(osp_t *osp)
+static struct exchange *exchange_alloc(void)
+{
+    return malloc(sizeof(struct exchange));
+}
+
+static int ack_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
+{
+    int rv = SCAN_SKIPPED;
+    struct ack *ack = arg;
+    if (frame->mid == 11 && frame->mid11.sid == ack->mid) {
+        ack->result = 0;
+        rv = SCAN_FINISHED;
+    } else if (frame->mid == 12 && frame->mid12.sid == ack->mid) {
+        ack->result = frame->mid12.nacid | 0x80;
+        rv = SCAN_FINISHED;
+    }
+    return rv;
+}
+
+static int finish_ack(struct exchange *ex, int retval)
+{
+    if (!retval && ex->data.ack.result) {
+        syslog(LOG_DEBUG, "mid %d nack: %d\n", ex->data.ack.mid, ex->data.ack.result);
+        retval = EAGAIN;
+    }
+    return retval;
+}
+
+/* Command answered with ACK or NACK */
+static void prepare_ack(struct exchange *ex, uint8_t mid)
+{
+    exchange_init(ex, ack_scanner, &ex->data.ack, 11, 12);
+    ex->data.ack.mid = mid;
+    ex->data.ack.result = -1;
+    ex->finish = finish_ack;
+}
+
+static void seed_cache(osp_t *osp, osp_position_t *seed, uint32_t clock_drift)
+{
+    if (seed) {
+        syslog(LOG_DEBUG, "init from seed");
+        pthread_mutex_lock(&osp->lock);
+        osp->cache.position.lat = seed->lat;
+        osp->cache.position.lon = seed->lon;
+        osp->cache.position.alt = seed->alt;
+        osp->cache.position.err_h = seed->err_h ? seed->err_h : SEED_ERR_H;
+        osp->cache.position.err_v = seed->err_v ? seed->err_v : SEED_ERR_V;
+        osp->cache.stamp = now_ns();
+        osp->cache.clock_drift = clock_drift;
+        osp->cache.valid = true;
+        pthread_mutex_unlock(&osp->lock);
+    }
+}
+
+static void prepare_init(struct exchange *ex, bool reset)
+{
+    prepare_ack(ex, 128);
+    ex->length = osp_build_init(ex->tx, 12, OSP_INIT_COLD
+            | (reset ? OSP_INIT_SYSTEM_RESET : 0));
+}
+
+int osp_init(osp_t *osp, bool reset, osp_position_t *seed, uint32_t clock_drift)
+{
+    struct exchange ex;
+    seed_cache(osp, seed, clock_drift);
+    prepare_init(&ex, reset);
+    return run(osp, &ex);
+}
+
+int osp_init_async(osp_t *osp, bool reset, osp_position_t *seed,
+        uint32_t clock_drift, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    seed_cache(osp, seed, clock_drift);
+    prepare_init(ex, reset);
+    return run_async(osp, ex, done, arg);
+}
+
+static void prepare_factory(struct exchange *ex, bool keep_prom, bool keep_xocw)
+{
+    prepare_ack(ex, 128);
+    ex->length = osp_build_init(ex->tx, 0, OSP_INIT_FACTORY
+            | (keep_xocw ? 0 : OSP_FACTORY_CLR_XOCW)
+            | (keep_prom ? OSP_FACTORY_KEEP_ROM : 0));
+}
+
+int osp_factory(osp_t *osp, bool keep_prom, bool keep_xocw)
+{
+    struct exchange ex;
+    prepare_factory(&ex, keep_prom, keep_xocw);
+    return run(osp, &ex);
+}
+
+int osp_factory_async(osp_t *osp, bool keep_prom, bool keep_xocw,
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_factory(ex, keep_prom, keep_xocw);
+    return run_async(osp, ex, done, arg);
+}
+
+static int ok_to_send_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
+{
+    int retval = SCAN_SKIPPED;
+    if (frame->mid == 18) {
+        retval = SCAN_FINISHED;
+    }
+    return retval;
+}
+
+/* Nothing is sent, only MID18 awaited */
+static void prepare_ready(struct exchange *ex)
 {
+    exchange_init(ex, ok_to_send_scanner, NULL, 18, NO_MID);
 }
 
-int osp_stop(osp_t *osp)
+int osp_wait_for_ready(osp_t *osp)
 {
-    driver_disable(osp->driver);
-    return 0;
+    struct exchange ex;
+    prepare_ready(&ex);
+    return run(osp, &ex);
 }
 
-inline static void set_scanner(osp_t *osp, scanner_f func, void *arg)
+int osp_wait_for_ready_async(osp_t *osp, osp_done_f done, void *arg)
 {
-    osp->scanner = func;
-    osp->scan_arg = arg;
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_ready(ex);
+    return run_async(osp, ex, done, arg);
 }
 
-inline static void clr_scanner(osp_t *osp)
+/* MID75 answers command sent as tx, echoing its MID and SID */
+static bool echoes(const osp_frame_t *frame, size_t len, const uint8_t *tx)
 {
-    set_scanner(osp, NULL, NULL);
+    return frame->mid == 75 && len >= 4
+        && frame->mid75.echo_mid == tx[0] && frame->mid75.echo_sid == tx[1];
 }
 
-static int transfer(osp_t *osp, size_t length, void *scanner, void *response)
+static int session_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
-    int retval;
-    struct timespec tow;
-
-    if (!(retval = osp_send(osp, length)) && scanner) {
-        clock_gettime(CLOCK_REALTIME, &tow);
-        tow.tv_sec += 8;
-        tow.tv_nsec = 0;
-        set_scanner(osp, scanner, response);
-        retval = pthread_cond_timedwait(&osp->signal, &osp->lock, &tow);
-        clr_scanner(osp);
+    int retval = SCAN_SKIPPED;
+    struct exchange *ex = arg;
+    uint8_t *response = ex->data.response;
+    if (frame->mid == 74) {
+        response[0] = frame->mid74.sid;
+        response[1] = frame->mid74.status;
+        retval = SCAN_FINISHED;
+    } else if (echoes(frame, len, ex->tx)) {
+        response[0] = 3;
+        retval = SCAN_FINISHED;
     }
     return retval;
 }
 
-static int ack_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+static int finish_session(struct exchange *ex, int retval)
 {
-    int rv = SCAN_SKIPPED;
-    int *ack = (int*)arg;
-    if (frame->mid == 11) {
-        *ack = 0;
-        rv = SCAN_FINISHED;
-    } else if (frame->mid == 12) {
-        *ack = frame->mid12.nacid | 0x80;
-        rv = SCAN_FINISHED;
+    uint8_t *response = ex->data.response;
+    /* response SID matches request SID */
+    if (!retval && (response[0] != ex->tx[1] || response[1] != 0)) {
+        retval = -1;
     }
-    return rv;
+    return retval;
 }
 
-int osp_init(osp_t *osp, bool reset, osp_position_t *seed, uint32_t clock_drift)
+static void prepare_session(struct exchange *ex, uint8_t sid, uint8_t request)
 {
-    int retval = EBUSY;
-    int ack = -1;
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        memset(frame, 0, 1 + sizeof(struct mid128));
-        frame->mid = 128;
-        frame->mid128.channels = 12;
-        if (seed) {
-            syslog(LOG_DEBUG, "init from seed");
-            osp->cache.position.lat = seed->lat;
-            osp->cache.position.lon = seed->lon;
-            osp->cache.position.alt = seed->alt;
-            osp->cache.clock_drift = clock_drift;
-            osp->cache.valid = true;
-        }
-
-        frame->mid128.soft.system_reset = reset;
-        frame->mid128.soft.cold = true;
+    exchange_init(ex, session_scanner, ex, 74, 75);
+    ex->length = osp_build_session(ex->tx, sid, request);
+    ex->finish = finish_session;
+}
 
-        retval = transfer(osp, 1 + sizeof(struct mid128), ack_scanner, &ack);
-        if (!retval && ack) {
-            syslog(LOG_DEBUG, "osp_init nack: %d\n", ack);
-            retval = EAGAIN;
-        }
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+int osp_open_session(osp_t *osp, bool resume)
+{
+    struct exchange ex;
+    prepare_session(&ex, SESSION_OPENING_REQUEST,
+            resume ? SESSION_RESUME_REQUEST
+                : SESSION_OPEN_REQUEST);
+    return run(osp, &ex);
 }
 
-int osp_factory(osp_t *osp, bool keep_prom, bool keep_xocw)
+int osp_open_session_async(osp_t *osp, bool resume, osp_done_f done, void *arg)
 {
-    int retval = EBUSY;
-    int ack = -1;
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_session(ex, SESSION_OPENING_REQUEST,
+            resume ? SESSION_RESUME_REQUEST
+                : SESSION_OPEN_REQUEST);
+    return run_async(osp, ex, done, arg);
+}
 
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        memset(frame, 0, 1 + sizeof(struct mid128));
-        frame->mid = 128;
-        frame->mid128.factory.factory = true;
-        frame->mid128.factory.protocol = 0;
-        frame->mid128.factory.clr_xocw = !keep_xocw;
-        frame->mid128.factory.keep_rom = keep_prom;
-
-        retval = transfer(osp, 1 + sizeof(struct mid128), ack_scanner, &ack);
-        if (!retval && ack) {
-            syslog(LOG_DEBUG, "osp_factory nack: %d\n", ack);
-            retval = EAGAIN;
-        }
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+static int hw_config_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
+{
+    return frame->mid == 71 ? SCAN_FINISHED : SCAN_SKIPPED;
 }
 
-static int ok_to_send_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+/* Nothing is sent, only MID71 awaited. Library answers it itself. */
+static void prepare_hw_config(struct exchange *ex)
 {
-    int retval = SCAN_SKIPPED;
-    if (frame->mid == 18) {
-        retval = SCAN_FINISHED;
-    }
-    return retval;
+    exchange_init(ex, hw_config_scanner, NULL, 71, NO_MID);
 }
 
-int osp_wait_for_ready(osp_t *osp)
+/* Give up on submitted exchange and wait for it */
+static void cancel(osp_t *osp, struct exchange *ex)
 {
-    int retval = EBUSY;
-    struct timespec tow;
     pthread_mutex_lock(&osp->lock);
-    clock_gettime(CLOCK_REALTIME, &tow);
-    tow.tv_sec += 5;
-    tow.tv_nsec = 0;
-    set_scanner(osp, ok_to_send_scanner, NULL);
-    retval = pthread_cond_timedwait(&osp->signal, &osp->lock, &tow);
-    clr_scanner(osp);
+    if (ex->state != EX_DONE)
+        complete(osp, ex, ECANCELED);
     pthread_mutex_unlock(&osp->lock);
-    return retval;
+    wait_for(osp, ex);
 }
 
-static int session_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+/* Time next exchange has for response counts from when previous step was
+ * reached, not from when it was armed */
+static int startup_step(osp_t *osp, struct exchange *ex, int phase,
+        struct exchange *next)
 {
-    int retval = SCAN_SKIPPED;
-    uint8_t *response = (uint8_t*)arg;
-    if (frame->mid == 74) {
-        response[0] = frame->mid74.sid;
-        response[1] = frame->mid74.status;
-        retval = SCAN_FINISHED;
-    } else if (frame->mid == 75) {
-        response[0] = 3;
-        retval = SCAN_FINISHED;
+    int retval = wait_for(osp, ex);
+    if (!retval) {
+        pthread_mutex_lock(&osp->lock);
+        startup_reached(osp, phase);
+        if (next && next->state == EX_ARMED)
+            next->deadline = now_ns() + exchange_timeout(osp, next);
+        pthread_mutex_unlock(&osp->lock);
     }
     return retval;
 }
 
-int osp_open_session(osp_t *osp, bool resume)
+int osp_startup(osp_t *osp, bool reset, osp_position_t *seed,
+        uint32_t clock_drift, osp_startup_report_t *report)
 {
-    int retval = EBUSY;
-    uint8_t response[2];
-    struct timespec tow;
-    clock_gettime(CLOCK_REALTIME, &tow);
-    tow.tv_sec += 5;
-    tow.tv_nsec = 0;
+    struct exchange init, ready, hw_config, session;
+    int retval;
 
     pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp->output.mid = 213;
-        osp->output.mid213.sid = SESSION_OPENING_REQUEST;
-        osp->output.mid213.request= resume ? SESSION_RESUME_REQUEST
-                                               : SESSION_OPEN_REQUEST;
-
-        retval = transfer(osp, 1 + sizeof(struct mid213), session_scanner, response);
+    if (osp->startup) {
+        pthread_mutex_unlock(&osp->lock);
+        return EBUSY;
+    }
+    memset(report, 0, sizeof(*report));
+    osp->startup = report;
+    osp->startup_begin = now_ns();
+    pthread_mutex_unlock(&osp->lock);
 
-        if (!retval && (response[0] != 1 || response[1] != 0)) {
-            retval = -1;
-        }
-        osp->busy = false;
+    /* Triggers of all phases are awaited from the start, so none is missed
+     * however quickly it follows the previous one */
+    seed_cache(osp, seed, clock_drift);
+    prepare_init(&init, reset);
+    prepare_ready(&ready);
+    prepare_hw_config(&hw_config);
+    submit(osp, &init);
+    submit(osp, &ready);
+    submit(osp, &hw_config);
+
+    retval = startup_step(osp, &init, OSP_STARTUP_INIT, &ready);
+    if (retval) {
+        cancel(osp, &ready);
+        cancel(osp, &hw_config);
+        goto out;
     }
+    retval = startup_step(osp, &ready, OSP_STARTUP_READY, &hw_config);
+    if (retval) {
+        cancel(osp, &hw_config);
+        goto out;
+    }
+    retval = startup_step(osp, &hw_config, OSP_STARTUP_HW_CONFIG, NULL);
+    if (retval)
+        goto out;
+
+    prepare_session(&session, SESSION_OPENING_REQUEST, SESSION_OPEN_REQUEST);
+    submit(osp, &session);
+    retval = startup_step(osp, &session, OSP_STARTUP_SESSION, NULL);
+out:
+    pthread_mutex_lock(&osp->lock);
+    osp->startup = NULL;
     pthread_mutex_unlock(&osp->lock);
     return retval;
 }
 
 int osp_close_session(osp_t *osp, bool suspend)
 {
-    int retval = EBUSY;
-    uint8_t response[2];
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp->output.mid = 213;
-        osp->output.mid213.sid = SESSION_CLOSING_REQUEST;
-        osp->output.mid213.request= suspend ? SESSION_SUSPEND_REQUEST
-                                               : SESSION_CLOSE_REQUEST;
+    struct exchange ex;
+    prepare_session(&ex, SESSION_CLOSING_REQUEST,
+            suspend ? SESSION_SUSPEND_REQUEST
+                : SESSION_CLOSE_REQUEST);
+    return run(osp, &ex);
+}
 
-        retval = transfer(osp, 1 + sizeof(struct mid213), session_scanner, response);
-        if (!retval && (response[0] != 2 || response[1] != 0)) {
-            retval = -1;
-        }
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+int osp_close_session_async(osp_t *osp, bool suspend, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_session(ex, SESSION_CLOSING_REQUEST,
+            suspend ? SESSION_SUSPEND_REQUEST
+                : SESSION_CLOSE_REQUEST);
+    return run_async(osp, ex, done, arg);
 }
 
-static int pwr_ack_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+static int pwr_ack_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
     int rv = SCAN_SKIPPED;
     uint8_t *data = (uint8_t*)arg;
@@ -571,57 +1810,73 @@ static int pwr_ack_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len
     return rv;
 }
 
-int osp_pwr_ptf(osp_t *osp, uint32_t period, uint32_t m_search, uint32_t m_off)
+static int finish_pwr_ptf(struct exchange *ex, int retval)
 {
-    int retval = EBUSY;
-    uint8_t response[2];
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        memset(frame, 0, 1 + sizeof(struct mid218));
-        frame->mid = 218;
-        frame->mid218.sid = 4;
-        frame->mid218.ptf.period = htobe32(period);
-        frame->mid218.ptf.max_search_time = htobe32(m_search);
-        frame->mid218.ptf.max_off_time = htobe32(m_off);
-
-        retval = transfer(osp, 1 + 1 + sizeof(struct ptf), pwr_ack_scanner, response);
-        if (!retval) {
-            retval = (response[0] != 4) ? EINVAL : response[1];
-        }
-        osp->busy = false;
+    uint8_t *response = ex->data.response;
+    if (!retval) {
+        retval = (response[0] != 4) ? EINVAL : response[1];
     }
-    pthread_mutex_unlock(&osp->lock);
     return retval;
 }
 
-int osp_pwr_full(osp_t *osp)
+static void prepare_pwr_ptf(struct exchange *ex,
+        uint32_t period, uint32_t m_search, uint32_t m_off)
 {
-    int retval = EBUSY;
-    uint8_t response[2];
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+    exchange_init(ex, pwr_ack_scanner, ex->data.response, 90, NO_MID);
+    ex->length = osp_build_pwr_ptf(ex->tx, period, m_search, m_off);
+    ex->finish = finish_pwr_ptf;
+}
+
+int osp_pwr_ptf(osp_t *osp, uint32_t period, uint32_t m_search, uint32_t m_off)
+{
+    struct exchange ex;
+    prepare_pwr_ptf(&ex, period, m_search, m_off);
+    return run(osp, &ex);
+}
 
-        osp_frame_t *frame = &osp->output;
-        memset(frame, 0, 1 + sizeof(struct mid218));
-        frame->mid = 218;
-        frame->mid218.sid = 0;
+int osp_pwr_ptf_async(osp_t *osp, uint32_t period, uint32_t m_search,
+        uint32_t m_off, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_pwr_ptf(ex, period, m_search, m_off);
+    return run_async(osp, ex, done, arg);
+}
 
-        retval = transfer(osp, 1 + 1, pwr_ack_scanner, response);
-        if (!retval && (response[0] || response[1])) {
-            retval = response[1];
-        }
-        osp->busy = false;
+static int finish_pwr_full(struct exchange *ex, int retval)
+{
+    uint8_t *response = ex->data.response;
+    if (!retval && (response[0] || response[1])) {
+        retval = response[1];
     }
-    pthread_mutex_unlock(&osp->lock);
     return retval;
 }
 
-static int poll_almanac_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+static void prepare_pwr_full(struct exchange *ex)
+{
+    exchange_init(ex, pwr_ack_scanner, ex->data.response, 90, NO_MID);
+    ex->length = osp_build_pwr_full(ex->tx);
+    ex->finish = finish_pwr_full;
+}
+
+int osp_pwr_full(osp_t *osp)
+{
+    struct exchange ex;
+    prepare_pwr_full(&ex);
+    return run(osp, &ex);
+}
+
+int osp_pwr_full_async(osp_t *osp, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_pwr_full(ex);
+    return run_async(osp, ex, done, arg);
+}
+
+static int poll_almanac_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
     int rv = SCAN_SKIPPED;
     uint8_t *data = (uint8_t*)arg;
@@ -640,61 +1895,61 @@ static int poll_almanac_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_
     return rv;
 }
 
-int osp_almanac_poll(osp_t *osp, almanac_t *almanac)
+static void prepare_almanac_poll(struct exchange *ex, almanac_t *almanac)
 {
-    int retval = EBUSY;
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+    exchange_init(ex, poll_almanac_scanner, almanac, 14, 11);
+    ex->length = osp_build_almanac_poll(ex->tx);
+}
 
-        osp_frame_t *frame = &osp->output;
-        memset(frame, 0, 1 + sizeof(struct mid146));
-        frame->mid = 146;
-        frame->mid146.control = 0;
+int osp_almanac_poll(osp_t *osp, almanac_t *almanac)
+{
+    struct exchange ex;
+    prepare_almanac_poll(&ex, almanac);
+    return run(osp, &ex);
+}
 
-        retval = transfer(osp, 1 + sizeof(struct mid146), poll_almanac_scanner, almanac);
+int osp_almanac_poll_async(osp_t *osp, almanac_t *almanac,
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_almanac_poll(ex, almanac);
+    return run_async(osp, ex, done, arg);
+}
 
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+static void prepare_almanac_set(struct exchange *ex, almanac_t *almanac)
+{
+    prepare_ack(ex, 130);
+    ex->length = osp_build_almanac_set(ex->tx, almanac);
 }
 
 int osp_almanac_set(osp_t *osp, almanac_t *almanac)
 {
-    int retval = EBUSY;
-    int ack = -1;
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 130;
-        memcpy(frame->mid130.rows, almanac, sizeof(struct mid130));
-        retval = transfer(osp, 1 + sizeof(struct mid130), ack_scanner, &ack);
-        if (!retval && ack) {
-            syslog(LOG_DEBUG, "osp_factory nack: %d\n", ack);
-            retval = EAGAIN;
-        }
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+    struct exchange ex;
+    prepare_almanac_set(&ex, almanac);
+    return run(osp, &ex);
 }
 
-struct poll_eph_result {
-    ephemeris_t *eph;
-    int count;
-};
+int osp_almanac_set_async(osp_t *osp, almanac_t *almanac,
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_almanac_set(ex, almanac);
+    return run_async(osp, ex, done, arg);
+}
 
-static int poll_eph_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+static int poll_eph_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
     int rv = SCAN_SKIPPED;
     if (frame->mid == 15) {
         struct poll_eph_result *result = arg;
 
+        /* polling all, there may be more than fit */
+        if (result->count == 12)
+            return SCAN_CONSUMED;
         result->eph[result->count].svid = frame->mid15.svid;
         memcpy(result->eph[result->count].data,
                 frame->mid15.data, sizeof(uint16_t)*45); /* FIXME: hardcoded size */
@@ -706,82 +1961,124 @@ static int poll_eph_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t le
     return rv;
 }
 
-int osp_ephemeris_poll(osp_t *osp, int svid, ephemeris_t eph[12])
+static int finish_eph_poll(struct exchange *ex, int retval)
 {
-    int retval = EBUSY;
-    struct poll_eph_result result;
-    result.eph = eph;
-    result.count = 0;
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        memset(eph, 0, sizeof(eph));
-        memset(frame, 0, 1 + sizeof(struct mid147));
-        frame->mid = 147;
-        frame->mid147.svid = svid;
-
-        retval = transfer(osp, 1 + sizeof(struct mid147), poll_eph_scanner, &result);
-        if (!retval) {
-            retval = result.count;
-        }
-        osp->busy = false;
+    if (!retval) {
+        retval = ex->data.eph.count;
     }
-    pthread_mutex_unlock(&osp->lock);
     return retval;
+}
+
+static void prepare_eph_poll(struct exchange *ex, int svid, ephemeris_t eph[12])
+{
+    exchange_init(ex, poll_eph_scanner, &ex->data.eph, 15, 11);
+    ex->data.eph.eph = eph;
+    ex->data.eph.count = 0;
+    memset(eph, 0, sizeof(eph));
+    ex->length = osp_build_ephemeris_poll(ex->tx, svid);
+    ex->finish = finish_eph_poll;
+}
+
+int osp_ephemeris_poll(osp_t *osp, int svid, ephemeris_t eph[12])
+{
+    struct exchange ex;
+    prepare_eph_poll(&ex, svid, eph);
+    return run(osp, &ex);
+}
+
+int osp_ephemeris_poll_async(osp_t *osp, int svid, ephemeris_t eph[12],
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_eph_poll(ex, svid, eph);
+    return run_async(osp, ex, done, arg);
+}
 
+static void prepare_eph_set(struct exchange *ex, ephemeris_t *eph)
+{
+    prepare_ack(ex, 149);
+    ex->length = osp_build_ephemeris_set(ex->tx, eph->data);
 }
 
 int osp_ephemeris_set(osp_t *osp, ephemeris_t *eph)
 {
-    int retval = EBUSY;
-    int ack = -1;
+    struct exchange ex;
+    prepare_eph_set(&ex, eph);
+    return run(osp, &ex);
+}
 
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
-
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 149;
-        memcpy(&frame->mid149, eph->data, sizeof(struct mid149));
-        retval = transfer(osp, 1 + sizeof(struct mid149), ack_scanner, &ack);
-        if (!retval && ack) {
-            syslog(LOG_DEBUG, "osp_ephemeris_set nack: %d\n", ack);
-            retval = EAGAIN;
+int osp_ephemeris_set_async(osp_t *osp, ephemeris_t *eph,
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_eph_set(ex, eph);
+    return run_async(osp, ex, done, arg);
+}
+
+int osp_ephemeris_set_all(osp_t *osp, ephemeris_t *eph, int count)
+{
+    int retval = 0, rv;
+    int i, sent;
+    struct exchange *ex;
+
+    if (count <= 0)
+        return EINVAL;
+    if (!(ex = calloc(count, sizeof(*ex))))
+        return ENOMEM;
+
+    /* All in flight at once, window permitting, each ACK completes the
+     * oldest outstanding one. Once window does not free up, receiver is
+     * not answering and the rest is not sent. */
+    for (sent = 0; sent < count; sent++) {
+        prepare_eph_set(&ex[sent], &eph[sent]);
+        if ((retval = submit(osp, &ex[sent]))) {
+            pthread_cond_destroy(&ex[sent].signal);
+            break;
         }
-        osp->busy = false;
     }
-    pthread_mutex_unlock(&osp->lock);
+    for (i = 0; i < sent; i++) {
+        rv = wait_for(osp, &ex[i]);
+        if (!retval)
+            retval = rv;
+    }
+    free(ex);
     return retval;
 }
 
-int osp_ephemeris_status(osp_t *osp, eph_status_t eph_status[12])
+/* Not answered, finished once sent */
+static void prepare_eph_status(struct exchange *ex)
 {
-    int retval = EBUSY;
-    int ack = -1;
-
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+    exchange_init(ex, NULL, NULL, NO_MID, NO_MID);
+    ex->length = osp_build_mid232(ex->tx, 2, 0xFF);
+}
 
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 232;
-        frame->mid232.sid = 2;
-        frame->mid232.svid_mask = htobe32(0xFF);
-        retval = transfer(osp, 1 + sizeof(struct mid232), NULL, NULL);
-        osp->busy = false;
-    }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+int osp_ephemeris_status(osp_t *osp, eph_status_t eph_status[12])
+{
+    struct exchange ex;
+    prepare_eph_status(&ex);
+    return run(osp, &ex);
+}
 
+int osp_ephemeris_status_async(osp_t *osp, eph_status_t eph_status[12],
+        osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_eph_status(ex);
+    return run_async(osp, ex, done, arg);
 }
 
-static int cw_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+static int cw_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
     int rv = SCAN_SKIPPED;
-    if (frame->mid == 75) {
-        printf("osp_cw: confirmed sid:%d: (%d, %d), %d\n",
+    struct exchange *ex = arg;
+    if (echoes(frame, len, ex->tx)) {
+        syslog(LOG_DEBUG, "osp_cw: confirmed sid:%d: (%d, %d), %d\n",
                 frame->mid75.sid,
                 frame->mid75.echo_mid,
                 frame->mid75.echo_sid,
@@ -792,46 +2089,278 @@ static int cw_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
     return rv;
 }
 
+static void prepare_cw(struct exchange *ex, bool enable)
+{
+    exchange_init(ex, cw_scanner, ex, 75, NO_MID);
+    ex->length = osp_build_cw(ex->tx, CW_MODE_SCAN_AUTO);
+}
+
 int osp_cw(osp_t *osp, bool enable)
 {
-    int retval = EBUSY;
+    struct exchange ex;
+    prepare_cw(&ex, enable);
+    return run(osp, &ex);
+}
 
-    pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+int osp_cw_async(osp_t *osp, bool enable, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_cw(ex, enable);
+    return run_async(osp, ex, done, arg);
+}
 
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 220;
-        frame->mid220.sid = 1;
-        frame->mid220.cw_mode = CW_MODE_SCAN_AUTO;
-        retval = transfer(osp, 1 + sizeof(struct mid220), cw_scanner, NULL);
-        osp->busy = false;
+int osp_latest_fix(osp_t *osp, osp_fix_t *fix)
+{
+    uint64_t begin, end;
+
+    do {
+        while ((begin = __atomic_load_n(&osp->fix_seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        *fix = osp->fix;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&osp->fix_seq, __ATOMIC_RELAXED);
+    } while (begin != end);
+
+    if (!begin) {
+        errno = ENOENT;
+        return -1;
     }
-    pthread_mutex_unlock(&osp->lock);
-    return retval;
+    return 0;
 }
 
-int osp_set_msg_rate(osp_t *osp, uint8_t mid, uint8_t mode, uint8_t rate)
+int osp_history(osp_t *osp, unsigned depth)
+{
+    struct history *h;
+
+    if (!depth) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (osp->history) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!(h = calloc(1, sizeof(*h))) || !(h->fixes = calloc(depth, sizeof(*h->fixes)))) {
+        free(h);
+        errno = ENOMEM;
+        return -1;
+    }
+    h->depth = depth;
+    pthread_mutex_init(&h->lock, NULL);
+    osp->history = h;
+    return 0;
+}
+
+/* Index of first fix not older than time, count if there is none. Called
+ * with history lock held. */
+static unsigned history_search(struct history *h, int64_t time)
+{
+    unsigned lo = 0, hi = h->count, mid;
+    const osp_history_fix_t *fix;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        fix = history_fix(h, mid);
+        if (gps_ms(fix->week, fix->tow) < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int osp_history_nearest(osp_t *osp, uint16_t week, uint32_t tow,
+        osp_history_fix_t *fix)
+{
+    struct history *h = osp->history;
+    const osp_history_fix_t *before, *after;
+    int64_t time = gps_ms(week, tow);
+    unsigned i;
+
+    if (!h) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&h->lock);
+    if (!h->count) {
+        pthread_mutex_unlock(&h->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    i = history_search(h, time);
+    if (i == h->count) {
+        *fix = *history_fix(h, i - 1);
+    } else if (i == 0) {
+        *fix = *history_fix(h, 0);
+    } else {
+        before = history_fix(h, i - 1);
+        after = history_fix(h, i);
+        *fix = time - gps_ms(before->week, before->tow)
+            <= gps_ms(after->week, after->tow) - time ? *before : *after;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return 0;
+}
+
+static inline int32_t lerp(int32_t a, int32_t b, double t)
+{
+    return lround(a + ((int64_t)b - a) * t);
+}
+
+/* Interpolates the short way around full circle of given units */
+static inline int64_t lerp_angle(int64_t a, int64_t b, double t, int64_t circle)
+{
+    int64_t d = b - a;
+    int64_t v;
+
+    if (d > circle / 2)
+        d -= circle;
+    else if (d < -circle / 2)
+        d += circle;
+    v = a + llround(d * t);
+    if (v > circle / 2)
+        v -= circle;
+    else if (v <= -circle / 2)
+        v += circle;
+    return v;
+}
+
+static void lerp_stamp(struct timespec *ts, const struct timespec *a,
+        const struct timespec *b, double t)
+{
+    int64_t ns = timespec_ns(a) + llround((timespec_ns(b) - timespec_ns(a)) * t);
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+int osp_history_interpolate(osp_t *osp, uint16_t week, uint32_t tow,
+        osp_history_fix_t *fix)
 {
-    int retval = EBUSY;
+    struct history *h = osp->history;
+    const osp_history_fix_t *a, *b;
+    int64_t time = gps_ms(week, tow);
+    int64_t ta, tb, course;
+    double t;
+    unsigned i;
+
+    if (!h) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&h->lock);
+    i = history_search(h, time);
+    if (i < h->count && gps_ms(history_fix(h, i)->week, history_fix(h, i)->tow) == time) {
+        *fix = *history_fix(h, i);
+        pthread_mutex_unlock(&h->lock);
+        return 0;
+    }
+    if (i == 0 || i == h->count)
+        goto history_miss;
+    a = history_fix(h, i - 1);
+    b = history_fix(h, i);
+    ta = gps_ms(a->week, a->tow);
+    tb = gps_ms(b->week, b->tow);
+    if (tb - ta > OSP_HISTORY_MAX_GAP)
+        goto history_miss;
+
+    t = (double)(time - ta) / (tb - ta);
+    memset(fix, 0, sizeof(*fix));
+    fix->week = week;
+    fix->tow = tow;
+    /* position error of the worse, satellites of the poorer of the two */
+    fix->svs_in_fix = a->svs_in_fix < b->svs_in_fix ? a->svs_in_fix : b->svs_in_fix;
+    fix->geodetic = a->geodetic && b->geodetic;
+    if (fix->geodetic) {
+        fix->lat = lerp(a->lat, b->lat, t);
+        fix->lon = lerp_angle(a->lon, b->lon, t, 3600000000ll);
+        fix->alt = lerp(a->alt, b->alt, t);
+        fix->speed = lerp(a->speed, b->speed, t);
+        course = lerp_angle(a->course, b->course, t, 36000);
+        fix->course = course < 0 ? course + 36000 : course;
+        fix->climb_rate = lerp(a->climb_rate, b->climb_rate, t);
+        fix->err_h = a->err_h > b->err_h ? a->err_h : b->err_h;
+        fix->err_v = a->err_v > b->err_v ? a->err_v : b->err_v;
+    }
+    fix->ecef = a->ecef && b->ecef;
+    if (fix->ecef) {
+        fix->x = lerp(a->x, b->x, t);
+        fix->y = lerp(a->y, b->y, t);
+        fix->z = lerp(a->z, b->z, t);
+        fix->vx = lerp(a->vx, b->vx, t);
+        fix->vy = lerp(a->vy, b->vy, t);
+        fix->vz = lerp(a->vz, b->vz, t);
+    }
+    lerp_stamp(&fix->arrival.mono, &a->arrival.mono, &b->arrival.mono, t);
+    lerp_stamp(&fix->arrival.real, &a->arrival.real, &b->arrival.real, t);
+    pthread_mutex_unlock(&h->lock);
+    return 0;
+
+history_miss:
+    pthread_mutex_unlock(&h->lock);
+    errno = ENOENT;
+    return -1;
+}
+
+int osp_set_timeout(osp_t *osp, uint8_t mid, unsigned ms)
+{
+    if (!ms) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&osp->lock);
+    osp->timeouts[mid] = ms;
+    pthread_mutex_unlock(&osp->lock);
+    return 0;
+}
 
+void osp_set_retry(osp_t *osp, const osp_retry_t *retry)
+{
     pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+    osp->retry = *retry;
+    pthread_mutex_unlock(&osp->lock);
+}
 
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 166;
-        frame->mid166.mode = mode;
-        frame->mid166.mid_to_set = mid;
-        frame->mid166.update_rate = rate;
-        retval = transfer(osp, 1 + sizeof(struct mid166), NULL, NULL);
-        osp->busy = false;
+int osp_set_window(osp_t *osp, unsigned depth)
+{
+    if (!depth) {
+        errno = EINVAL;
+        return -1;
     }
+    pthread_mutex_lock(&osp->lock);
+    osp->window = depth;
+    pthread_cond_broadcast(&osp->room);
     pthread_mutex_unlock(&osp->lock);
-    return retval;
+    settle(osp);
+    return 0;
+}
+
+/* Not answered, finished once sent */
+static void prepare_msg_rate(struct exchange *ex, uint8_t mid, uint8_t mode, uint8_t rate)
+{
+    exchange_init(ex, NULL, NULL, NO_MID, NO_MID);
+    ex->length = osp_build_msg_rate(ex->tx, mode, mid, rate);
 }
 
-static int version_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len)
+int osp_set_msg_rate(osp_t *osp, uint8_t mid, uint8_t mode, uint8_t rate)
+{
+    struct exchange ex;
+    prepare_msg_rate(&ex, mid, mode, rate);
+    return run(osp, &ex);
+}
+
+int osp_set_msg_rate_async(osp_t *osp, uint8_t mid, uint8_t mode,
+        uint8_t rate, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_msg_rate(ex, mid, mode, rate);
+    return run_async(osp, ex, done, arg);
+}
+
+static int version_scanner(osp_t *osp, void *arg, const osp_frame_t *frame, size_t len)
 {
     int rv = SCAN_SKIPPED;
     if (frame->mid == 6) {
@@ -842,23 +2371,69 @@ static int version_scanner(osp_t *osp, void *arg, osp_frame_t *frame, size_t len
     return rv;
 }
 
+static void prepare_version(struct exchange *ex, char *version)
+{
+    exchange_init(ex, version_scanner, version, 6, NO_MID);
+    ex->length = osp_build_version_poll(ex->tx);
+}
+
 int osp_version(osp_t *osp, char *version)
 {
-    int retval = EBUSY;
+    struct exchange ex;
+    prepare_version(&ex, version);
+    return run(osp, &ex);
+}
+
+int osp_version_async(osp_t *osp, char *version, osp_done_f done, void *arg)
+{
+    struct exchange *ex = exchange_alloc();
+    if (!ex)
+        return ENOMEM;
+    prepare_version(ex, version);
+    return run_async(osp, ex, done, arg);
+}
 
+int osp_completion_fd(osp_t *osp)
+{
     pthread_mutex_lock(&osp->lock);
-    if (!osp->busy) {
-        osp->busy = true;
+    if (osp->completion_fd < 0)
+        osp->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&osp->lock);
+    return osp->completion_fd;
+}
+
+int osp_process_completions(osp_t *osp)
+{
+    uint64_t count;
+    if (osp->completion_fd >= 0 &&
+            read(osp->completion_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+    if (expire(osp))
+        pump(osp);
+    return run_completions(osp);
+}
 
-        osp_frame_t *frame = &osp->output;
-        frame->mid = 132;
-        frame->mid132.reserved = 0;
-        retval = transfer(osp, 1 + sizeof(struct mid132), version_scanner, version);
-        osp->busy = false;
+int osp_completion_timeout(osp_t *osp)
+{
+    struct exchange *ex;
+    int64_t next = INT64_MAX;
+    int64_t left;
+
+    /* Deadlines of sent commands and ends of backoff of retries */
+    pthread_mutex_lock(&osp->lock);
+    for (ex = osp->pending; ex; ex = ex->next) {
+        if (ex->deadline < next)
+            next = ex->deadline;
+        if (ex->state == EX_QUEUED && ex->not_before && ex->not_before < next)
+            next = ex->not_before;
     }
     pthread_mutex_unlock(&osp->lock);
-    return retval;
+    if (next == INT64_MAX)
+        return -1;
 
+    left = next - now_ns();
+    /* rounded up, not to wake up before deadline */
+    return left > 0 ? (left + 999999) / 1000000 : 0;
 }
 
 /* vim: set ts=4 sw=4 et: */
@@ -6,6 +6,8 @@
 
 #include "osp-transport.h"
 #include "osp-protocol.h"
+#include "osp-decode.h"
+#include "osp-capture.h"
 
 typedef struct osp_position {
     int32_t lat;    /* Latitude (x10^7) */
@@ -15,6 +17,10 @@ typedef struct osp_position {
     uint32_t err_v; /* Vertical error in meters */
 } osp_position_t;
 
+/* Growth of position error since fix, m/s, assuming receiver may have
+ * moved at walking pace */
+#define OSP_POSITION_GROWTH 2
+
 typedef struct {
     uint8_t svid;
     uint16_t data[45];
@@ -33,18 +39,166 @@ typedef uint8_t almanac_t[28*32];
 
 typedef struct {
     void (*location)(void *arg, int svs, int32_t lat, int32_t lon, time_t time);
+    /* Every incoming frame with its arrival time. View is valid during the
+     * call only, unless held with osp_frame_hold() (zero-copy mode). */
+    void (*frame)(void *arg, const osp_frame_view_t *view);
 } osp_callbacks_t;
 
-enum { OSP_INCOMING, OSP_OUTGOING };
+/* Geodetic navigation data of a fix as received, valid or not, see
+ * nav.nav_valid */
+typedef struct {
+    osp_mid41_t nav;
+    osp_stamp_t arrival;
+    uint64_t number;            /* of MID41 since start, changes with new fix */
+} osp_fix_t;
+
+/* Decoded message of subscribed MID. Message and view are valid during
+ * the call only. */
+typedef void (*osp_msg_f)(void *arg, const osp_msg_t *msg,
+        const osp_frame_view_t *view);
+
+#define OSP_SID_ANY (-1)
+
+/* Commands in flight at once by default */
+#define OSP_WINDOW 4
 
 struct osp;
 typedef struct osp osp_t;
 
 osp_t* osp_alloc(driver_t* driver, const osp_callbacks_t *cb, void *cb_arg);
+void osp_free(osp_t *osp);
 int osp_start(osp_t *osp);
 int osp_stop(osp_t *osp);
 int osp_running(osp_t *osp);
 
+/* Push mode, without driver and threads of its own. Caller reads the
+ * receiver however it likes and feeds bytes with osp_feed(); handlers,
+ * callbacks and subscribers then run inside osp_feed() unless there is a
+ * dispatch worker. Frames sent are encoded and passed to sink, which
+ * returns 0 once it took them whole. Synchronous commands block until
+ * their response is fed, so in push mode they must be issued from another
+ * thread than the feeding one; event loops use asynchronous commands with
+ * osp_completion_fd() and osp_completion_timeout() instead. */
+typedef int (*osp_sink_f)(void *arg, const void *bytes, size_t length);
+
+osp_t* osp_alloc_sink(osp_sink_f sink, void *sink_arg,
+        const osp_callbacks_t *cb, void *cb_arg);
+/* Bytes as read, any split. Fails with EINVAL if osp is not in push mode. */
+int osp_feed(osp_t *osp, const void *bytes, size_t length);
+/* NMEA sentences found between frames fed */
+void osp_feed_nmea(osp_t *osp, osp_nmea_f cb, void *arg);
+void osp_feed_stats(osp_t *osp, osp_transport_stats_t *stats);
+
+/* Transport driver reads from. Frames then carry time of their arrival
+ * instead of time of dispatch. */
+void osp_set_transport(osp_t *osp, io_t *transport);
+
+/* Let transport own receive buffers and hand frames to dispatcher without
+ * copying. Transport must be the one driver reads from. Call before start. */
+int osp_zero_copy(osp_t *osp, io_t *transport, unsigned buffers);
+
+/* Policy of dispatch worker queue when it is full */
+enum {
+    OSP_QUEUE_DROP_OLDEST,
+    OSP_QUEUE_BLOCK,            /* receiving thread waits, tty may overrun */
+};
+
+typedef struct {
+    uint64_t queued;
+    uint64_t dropped;           /* oldest frames not dispatched */
+    uint64_t blocked;           /* times receiving thread waited for room */
+    uint64_t high_water;        /* most frames queued at once */
+} osp_queue_stats_t;
+
+/* Run dispatch, with handlers, callbacks, subscribers and completions, on
+ * a worker thread fed through a queue of depth frames; receiving thread
+ * then only reads and frames. Call before start, fails with EBUSY after
+ * it. In zero-copy mode queued frames hold pool buffers, so depth should
+ * be below their count. */
+int osp_dispatch_worker(osp_t *osp, unsigned depth, int policy);
+void osp_queue_stats(osp_t *osp, osp_queue_stats_t *stats);
+
+/* Record every frame sent and received to capture, NULL stops recording.
+ * Capture must outlive recording. */
+void osp_set_capture(osp_t *osp, osp_capture_t *capture);
+
+/* Call cb with every mid message, or only these carrying sid when not
+ * OSP_SID_ANY. Fails with ENOTSUP for MID without decoder and EINVAL for
+ * sid of MID which carries none. Subscribers run on receiving thread and
+ * must not (un)subscribe themselves. */
+int osp_subscribe(osp_t *osp, uint8_t mid, int sid, osp_msg_f cb, void *arg);
+int osp_unsubscribe(osp_t *osp, uint8_t mid, osp_msg_f cb, void *arg);
+
+/* Copy of latest MID41, taken without locking and without delaying
+ * receiving thread; any number of threads may poll it. Returns 0, or -1
+ * with errno ENOENT if none was received yet. */
+int osp_latest_fix(osp_t *osp, osp_fix_t *fix);
+
+/* Valid fix of fix history, merged from MID41 and MID2 of the same time */
+typedef struct {
+    uint16_t week;              /* extended */
+    uint32_t tow;               /* ms */
+    bool geodetic;              /* MID41 fields below are set */
+    int32_t lat;                /* deg x10^7 */
+    int32_t lon;                /* deg x10^7 */
+    int32_t alt;                /* above mean sea level, cm */
+    uint16_t speed;             /* over ground, cm/s */
+    uint16_t course;            /* deg x100 */
+    int16_t climb_rate;         /* cm/s */
+    uint32_t err_h;             /* cm */
+    uint32_t err_v;             /* cm */
+    bool ecef;                  /* MID2 fields below are set */
+    int32_t x, y, z;            /* m */
+    int16_t vx, vy, vz;         /* m/s x8 */
+    uint8_t svs_in_fix;
+    osp_stamp_t arrival;        /* of first message of fix */
+} osp_history_fix_t;
+
+/* Fixes further apart are not interpolated between, ms */
+#define OSP_HISTORY_MAX_GAP 5000
+
+/* Keep last depth valid fixes, in memory allocated now. Call before start.
+ * History starts over when receiver time goes back by more than a second or
+ * to previous week; fix slightly older than the newest one is not kept. */
+int osp_history(osp_t *osp, unsigned depth);
+/* Fix closest to GPS time, or fix at it interpolated between the two
+ * around it. Any thread may look up. Fail with ENOENT when there is no
+ * such fix, or EINVAL when history is not kept. */
+int osp_history_nearest(osp_t *osp, uint16_t week, uint32_t tow,
+        osp_history_fix_t *fix);
+int osp_history_interpolate(osp_t *osp, uint16_t week, uint32_t tow,
+        osp_history_fix_t *fix);
+
+/* Commands in flight at once. Commands beyond wait for earlier ones to be
+ * answered. */
+int osp_set_window(osp_t *osp, unsigned depth);
+
+/* Retries of commands timing out */
+typedef struct {
+    unsigned retries;           /* resends after first attempt */
+    unsigned backoff_ms;        /* before first resend, doubled for next */
+    unsigned backoff_max_ms;    /* 0 for no limit */
+} osp_retry_t;
+
+/* Time command with request mid has for response, counted from sending.
+ * osp_wait_for_ready() waits for MID18. */
+int osp_set_timeout(osp_t *osp, uint8_t mid, unsigned ms);
+void osp_set_retry(osp_t *osp, const osp_retry_t *retry);
+
+/* Completion of asynchronous command, result is what synchronous variant
+ * would return */
+typedef void (*osp_done_f)(void *arg, int result);
+
+/* Pollable descriptor, readable once asynchronous commands complete. After
+ * it is created done callbacks run only from osp_process_completions(). */
+int osp_completion_fd(osp_t *osp);
+/* Run done callbacks of completed commands and time out overdue ones.
+ * Returns number of callbacks run. */
+int osp_process_completions(osp_t *osp);
+/* Milliseconds until next command times out, -1 if none. Suitable as poll
+ * timeout next to completion descriptor. */
+int osp_completion_timeout(osp_t *osp);
+
 /* OSP operations */
 int osp_init(osp_t *osp, bool reset, osp_position_t *seed, uint32_t clock_drift);
 int osp_factory(osp_t *osp, bool keep_prom, bool keep_xocw);
@@ -58,10 +212,66 @@ int osp_almanac_set(osp_t *osp, almanac_t *almanac);
 int osp_ephemeris_status(osp_t *osp, eph_status_t eph_status[12]);
 int osp_ephemeris_poll(osp_t *osp, int svid, ephemeris_t eph[12]);
 int osp_ephemeris_set(osp_t *osp, ephemeris_t eph[12]);
+/* Set count ephemerides pipelined, returns first failure */
+int osp_ephemeris_set_all(osp_t *osp, ephemeris_t *eph, int count);
 int osp_cw(osp_t *osp, bool enable);
 int osp_set_msg_rate(osp_t *osp, uint8_t mid, uint8_t mode, uint8_t rate);
 int osp_version(osp_t *osp, char *version);
 
+/* Start-up phases, in order receiver usually gets through them */
+enum {
+    OSP_STARTUP_INIT,           /* MID128 acknowledged */
+    OSP_STARTUP_READY,          /* OkToSend - MID18 */
+    OSP_STARTUP_HW_CONFIG,      /* Hardware configuration request - MID71 answered */
+    OSP_STARTUP_POSITION,       /* Position request - MID73 answered */
+    OSP_STARTUP_TIME,           /* Time transfer request - MID73 answered */
+    OSP_STARTUP_SESSION,        /* Session opened - MID74 */
+    OSP_STARTUP_PHASES
+};
+
+typedef struct {
+    unsigned reached;                   /* 1 << OSP_STARTUP_* */
+    uint32_t at_us[OSP_STARTUP_PHASES]; /* since start-up began */
+} osp_startup_report_t;
+
+/* Initialize receiver and open session, each step taken as soon as the
+ * receiver asks for it. Transfer requests are answered whenever they come
+ * and only reported. Returns result of first step failing. */
+int osp_startup(osp_t *osp, bool reset, osp_position_t *seed,
+        uint32_t clock_drift, osp_startup_report_t *report);
+
+/* Asynchronous variants. Return 0 once command is queued, done is called
+ * exactly once later. Buffers passed must stay valid until then. Without
+ * completion descriptor, done runs on thread which completed command,
+ * receiving one usually, and must not call synchronous commands.
+ * Overdue commands are timed out as frames arrive or other commands are
+ * issued. When receiver may go silent with nothing else issued, call
+ * osp_process_completions() after osp_completion_timeout() elapses. */
+int osp_init_async(osp_t *osp, bool reset, osp_position_t *seed,
+        uint32_t clock_drift, osp_done_f done, void *arg);
+int osp_factory_async(osp_t *osp, bool keep_prom, bool keep_xocw,
+        osp_done_f done, void *arg);
+int osp_wait_for_ready_async(osp_t *osp, osp_done_f done, void *arg);
+int osp_open_session_async(osp_t *osp, bool resume, osp_done_f done, void *arg);
+int osp_close_session_async(osp_t *osp, bool suspend, osp_done_f done, void *arg);
+int osp_pwr_ptf_async(osp_t *osp, uint32_t period, uint32_t m_search,
+        uint32_t m_off, osp_done_f done, void *arg);
+int osp_pwr_full_async(osp_t *osp, osp_done_f done, void *arg);
+int osp_almanac_poll_async(osp_t *osp, almanac_t *almanac,
+        osp_done_f done, void *arg);
+int osp_almanac_set_async(osp_t *osp, almanac_t *almanac,
+        osp_done_f done, void *arg);
+int osp_ephemeris_status_async(osp_t *osp, eph_status_t eph_status[12],
+        osp_done_f done, void *arg);
+int osp_ephemeris_poll_async(osp_t *osp, int svid, ephemeris_t eph[12],
+        osp_done_f done, void *arg);
+int osp_ephemeris_set_async(osp_t *osp, ephemeris_t *eph,
+        osp_done_f done, void *arg);
+int osp_cw_async(osp_t *osp, bool enable, osp_done_f done, void *arg);
+int osp_set_msg_rate_async(osp_t *osp, uint8_t mid, uint8_t mode,
+        uint8_t rate, osp_done_f done, void *arg);
+int osp_version_async(osp_t *osp, char *version, osp_done_f done, void *arg);
+
 #endif /*_OSP_H */
 
 /* vim: set ts=4 sw=4 et: */